@@ -8,13 +8,19 @@ extern "C" {
 	extern union system_data sdata;
 }
 
+static LiquidCrystal lcd(8, 9, 4, 5, 6, 7);
+
+// lcd.begin() waits over 50 ms for the display to power up, far more than
+// lcd_task's wcet, so it is done once before the periodic task is created
+extern "C" void lcd_init() {
+	lcd.begin(16,2);
+	lcd.setCursor(0,0);
+}
+
 extern "C" void lcd_task() {
-	LiquidCrystal lcd(8, 9, 4, 5, 6, 7);
 	unsigned long int i;
 	char line1 [17];
 	char line2 [17];
-	lcd.begin(16,2);
-	lcd.setCursor(0,0);
 	for(;;) {
 		snprintf(line1, 17, "%4d %4d %1d", sdata.state.sjs_x, sdata.state.sjs_y, sdata.state.sjs_z);
 		snprintf(line2, 17, "%4d %4d %5d", sdata.state.rjs_x, sdata.state.rjs_y, 0);
@@ -35,6 +35,8 @@
 #ifndef NO_RX1_INTERRUPT
 	volatile uint8_t rx1_Tail, rx1_Head;
 	char rx1_buffer[RX1_BUFFER_SIZE];
+	
+	void __attribute__((weak)) uart1_rx_event(void) {}
 #endif
 
 #ifndef NO_TX2_INTERRUPT
@@ -45,6 +47,8 @@
 #ifndef NO_RX2_INTERRUPT
 	volatile uint8_t rx2_Tail, rx2_Head;
 	char rx2_buffer[RX2_BUFFER_SIZE];
+	
+	void __attribute__((weak)) uart2_rx_event(void) {}
 #endif
 
 #ifndef NO_TX3_INTERRUPT
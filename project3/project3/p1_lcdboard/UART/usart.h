@@ -1883,6 +1883,9 @@ enum {COMPLETED = 1, BUFFER_EMPTY = 0, BUFFER_FULL = 0};
 		// returns number of bytes waiting in the receiver buffer
 		
 		uint8_t uart1_peek(void); // returns next byte from buffer // returned byte is invalid if there is nothing to read
+		
+		void uart1_rx_event(void); // called by the RX ISR, with interrupts disabled, for every byte it buffers
+		// does nothing unless the application defines it (see RX1_LATE_RECEIVE_EVENT)
 	#endif // NO_RX0_INTERRUPT
 	
 	#ifndef NO_RX2_INTERRUPT
@@ -1911,6 +1914,9 @@ enum {COMPLETED = 1, BUFFER_EMPTY = 0, BUFFER_FULL = 0};
 		// returns number of bytes waiting in the receiver buffer
 		
 		uint8_t uart2_peek(void); // returns next byte from buffer // returned byte is invalid if there is nothing to read
+		
+		void uart2_rx_event(void); // called by the RX ISR, with interrupts disabled, for every byte it buffers
+		// does nothing unless the application defines it (see RX2_LATE_RECEIVE_EVENT)
 	#endif // NO_RX0_INTERRUPT
 	
 	#ifndef NO_RX3_INTERRUPT
@@ -237,6 +237,35 @@
 
 #define RX0_INPUT_OPERAND_LIST
 
+// calls the C function "f" from a RX*_LATE_RECEIVE_EVENT hook: the ISR has only
+// saved r16 (or SREG), r25, r30 and r31, so the other registers a C function may
+// clobber are saved around the call, and r1 is cleared as C code expects it to be
+#define USART_RX_CALL(f) \
+	"push	r0 \n\t" \
+	"push	r1 \n\t" \
+	"clr	r1 \n\t" \
+	"push	r18 \n\t" \
+	"push	r19 \n\t" \
+	"push	r20 \n\t" \
+	"push	r21 \n\t" \
+	"push	r22 \n\t" \
+	"push	r23 \n\t" \
+	"push	r24 \n\t" \
+	"push	r26 \n\t" \
+	"push	r27 \n\t" \
+	"call	" #f " \n\t" \
+	"pop	r27 \n\t" \
+	"pop	r26 \n\t" \
+	"pop	r24 \n\t" \
+	"pop	r23 \n\t" \
+	"pop	r22 \n\t" \
+	"pop	r21 \n\t" \
+	"pop	r20 \n\t" \
+	"pop	r19 \n\t" \
+	"pop	r18 \n\t" \
+	"pop	r1 \n\t" \
+	"pop	r0 \n\t"
+
 //************************************************
 
 #define TX1_EVERYCAL_EVENT "\n\t"
@@ -253,7 +282,7 @@
 
 #define RX1_EVERYCALL_EVENT "\n\t"
 #define RX1_EARLY_RECEIVE_EVENT "\n\t"
-#define RX1_LATE_RECEIVE_EVENT "\n\t"
+#define RX1_LATE_RECEIVE_EVENT USART_RX_CALL(uart1_rx_event) // see usart.h
 
 #define RX1_INPUT_OPERAND_LIST
 
@@ -273,7 +302,7 @@
 
 #define RX2_EVERYCALL_EVENT "\n\t"
 #define RX2_EARLY_RECEIVE_EVENT "\n\t"
-#define RX2_LATE_RECEIVE_EVENT "\n\t"
+#define RX2_LATE_RECEIVE_EVENT USART_RX_CALL(uart2_rx_event) // see usart.h
 
 #define RX2_INPUT_OPERAND_LIST
 
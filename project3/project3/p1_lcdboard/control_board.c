@@ -6,6 +6,7 @@
 #include "UART/usart.h"
 #include <avr/delay.h>
 
+extern void lcd_init();
 extern void lcd_task();
 
 static uint8_t analog_reference = DEFAULT;
@@ -82,11 +83,33 @@ void send_bt() {
 	}
 }
 
+// a periodic task that admission control refuses stops the board at startup,
+// blinking the reason, rather than leaving the task out
+static PID admitted(PID pid) {
+	if (pid == 0) {
+		OS_Abort(Task_Admission_Error());
+	}
+	return pid;
+}
+
 void a_main() {
+	PID pid;
 	analogReference(DEFAULT);
-	Task_Create_Period(joystick_task, 0, 5, 10, 0);
-	Task_Create_Period(lcd_task, 0, 25, 100, 10);
-	Task_Create_Period(send_bt, 0, 5, 1, 6);
+	lcd_init();
+	// NOTE: the wcets of joystick and send_bt are not measured. Their jobs
+	// are expected to take well under a TICK, so they own no TICK of their
+	// own (wcet 0): admission control only checks them against lcd_task,
+	// which owns one in every 25, away from their releases, and they are
+	// only late once they run into their next release. Measure exec_max
+	// with EXEC_STATS before relying on it.
+	// a late joystick or radio job skips a period; the LCD, which is only
+	// for show, is demoted to a RR task if it cannot keep up
+	pid = admitted(Task_Create_Period(joystick_task, 0, 5, 0, 0));
+	Task_Overrun_Policy(pid, OVERRUN_SKIP);
+	pid = admitted(Task_Create_Period(lcd_task, 0, 25, 1, 12));
+	Task_Overrun_Policy(pid, OVERRUN_DEMOTE);
+	pid = admitted(Task_Create_Period(send_bt, 0, 5, 0, 6));
+	Task_Overrun_Policy(pid, OVERRUN_SKIP);
 }
 
 #endif
@@ -25,6 +25,10 @@ SREG  = 0x3F
 SPH    = 0x3E
 SPL    = 0x3D
 
+/* marker on top of a switched-out task's stack: which frame is below it */
+FRAME_SHORT = 0   ; SAVECALLEE only; must match FRAME_SHORT in os.c
+FRAME_FULL  = 1   ; SAVECISR + SAVECTX
+
 /*
   * MACROS
   */
@@ -32,7 +36,8 @@ SPL    = 0x3D
 ; Push all registers and then the status register.
 ; It is important to keep the order of SAVECTX and RESTORECTX  exactly
 ; in reverse. Also, when a new process is created, it is important to 
-; initialize its "initial" context in the same order as SAVECTX.
+; initialize its "initial" context in the same order as SAVECALLEE, since
+; it starts from a short frame (see FRAME_SHORT).
 ;
 
 ; this macro is written to emulate what registers are put on the stack when a C ISR is created
@@ -77,6 +82,55 @@ SPL    = 0x3D
 	push	r31
 .endm
 ;
+; Push only the registers the AVR ABI makes a called function preserve.
+; This is enough for every switch that starts as a function call, i.e.,
+; Enter_Kernel() from a task and CSwitch() from the kernel: the caller
+; already expects r0, r18-r27, r30, r31 and SREG to be clobbered, and r1
+; to be 0 on return.
+;
+.macro	SAVECALLEE
+	push	r2
+	push	r3
+	push	r4
+	push	r5
+	push	r6
+	push	r7
+	push	r8
+	push	r9
+	push	r10
+	push	r11
+	push	r12
+	push	r13
+	push	r14
+	push	r15
+	push	r16
+	push	r17
+	push	r28
+	push	r29
+.endm
+
+.macro	RESTORECALLEE
+	pop	r29
+	pop	r28
+	pop	r17
+	pop	r16
+	pop	r15
+	pop	r14
+	pop	r13
+	pop	r12
+	pop	r11
+	pop	r10
+	pop	r9
+	pop	r8
+	pop	r7
+	pop	r6
+	pop	r5
+	pop	r4
+	pop	r3
+	pop	r2
+	clr	r1
+.endm
+;
 ; Pop all registers and the status registers
 ;
 .macro	RESTORECTX
@@ -124,6 +178,8 @@ SPL    = 0x3D
         .extern  KernelSp
         .extern  CurrentSp
 		.extern tick_count
+		.extern tick_step
+		.extern kernel_timer_entry
 /*
   * The actual CSwitch() code begins here.
   *
@@ -144,10 +200,10 @@ Exit_Kernel:
         /* 
           * This is the "top" half of CSwitch(), generally called by the kernel.
           * Assume I = 0, i.e., all interrupts are disabled.
+          * The kernel always gets here by a function call, so only its
+          * callee-saved registers need saving.
           */
-		SAVECISR 
-
-        SAVECTX
+        SAVECALLEE
         /* 
           * Now, we have saved the kernel's context.
           * Save the current H/W stack pointer into KernelSp.
@@ -167,10 +223,18 @@ Exit_Kernel:
         /*
           * We are now executing in Cp's stack.
           * Note: at the bottom of the Cp's context is its return address.
+          * The marker on top tells which frame Cp left on its stack.
           */
+        pop  r24
+        cpi  r24, FRAME_SHORT
+        breq Exit_Kernel_Short
         RESTORECTX
 		call Disable_Interrupt_Probe
         reti         /* re-enable all global interrupts */
+Exit_Kernel_Short:
+        RESTORECALLEE
+		call Disable_Interrupt_Probe
+        reti
 /*
   * All system call eventually enters here!
   * There are two possibilities how we get here: 
@@ -204,16 +268,35 @@ Disable_Interrupt_Probe:
 	pop r16
 	ret
 
+; tick_count += tick_step; tick_step = 1 (tick_count is 32 bits)
+; tick_step is only > 1 while the kernel has stretched TIMER4 for tickless idle
+; assumes r1 == 0, which the C ISR prologue guarantees
 inc_tick_count:
+	push r22
+	push r23
 	push r24
 	push r25
-	lds r24, tick_count
-	lds r25, tick_count+1
-	adiw r24, 0x01
-	sts  tick_count+1, r25
-	sts tick_count, r24
+	push r26
+	lds r26, tick_step
+	lds r22, tick_count
+	lds r23, tick_count+1
+	lds r24, tick_count+2
+	lds r25, tick_count+3
+	add r22, r26
+	adc r23, r1
+	adc r24, r1
+	adc r25, r1
+	sts tick_count+3, r25
+	sts tick_count+2, r24
+	sts tick_count+1, r23
+	sts tick_count, r22
+	ldi r26, 0x01
+	sts tick_step, r26
+	pop r26
 	pop r25
 	pop r24
+	pop r23
+	pop r22
 	ret
 
 // interrupt triggered when kernel hasn't finished booting
@@ -230,17 +313,29 @@ Enter_Kernel_Interrupt:
 	lds r1, KernelActive
 	tst r1
 	breq Kernel_Inactive
+	sts kernel_timer_entry, r1	; r1 == KernelActive != 0: tell the kernel Cp was preempted
 	jmp Enter_Kernel_Active	
 
+/*
+  * A voluntary entry is a function call from Cp, so a short frame will do.
+  */
 Enter_Kernel:
-	SAVECISR   
+	call Enable_Interrupt_Probe
+    SAVECALLEE
+    ldi  r24, FRAME_SHORT
+    push r24
+    jmp  Enter_Kernel_Saved
+
+Enter_Kernel_Active:
     /*
         * This is the "bottom" half of CSwitch(). We are still executing in
-        * Cp's context.
+        * Cp's context, which was interrupted anywhere: save all of it.
         */
-Enter_Kernel_Active:
 	call Enable_Interrupt_Probe
     SAVECTX
+    ldi  r24, FRAME_FULL
+    push r24
+Enter_Kernel_Saved:
     /* 
         * Now, we have saved the Cp's context.
         * Save the current H/W stack pointer into CurrentSp.
@@ -260,7 +355,7 @@ Enter_Kernel_Active:
     /*
         * We are now executing in kernel's stack.
         */
-    RESTORECTX
+    RESTORECALLEE
     /* 
         * We are ready to return to the caller of CSwitch() (or Exit_Kernel()).
         * Note: We should NOT re-enable interrupts while kernel is running.
@@ -0,0 +1,21 @@
+/**
+ * \file interrupt.h
+ * \brief Host stand-in for <avr/interrupt.h>
+ *
+ * The global interrupt flag is emulated in port.c; an "interrupt" is the
+ * SIGALRM handler which drives the emulated TIMER4, and which also runs the
+ * handlers that tests raise with Port_Interrupt().
+ */
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+extern void Port_Cli(void);
+extern void Port_Sei(void);
+extern void Port_Interrupt(void (*isr)(void));
+
+#define cli() Port_Cli()
+#define sei() Port_Sei()
+
+#define ISR(vector, ...) void vector(void)
+
+#endif /* HOST_AVR_INTERRUPT_H */
@@ -0,0 +1,56 @@
+/**
+ * \file io.h
+ * \brief Host stand-in for <avr/io.h>
+ *
+ * The I/O registers that os.c, test_tasks.c and UART/usart.h touch are plain
+ * variables, defined in port.c. TCNT4 and TIFR4 are computed by the emulated
+ * TIMER4 in port.c, so that they read the same as on the ATmega2560.
+ */
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#define __flash
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+
+#define HOST_USART_REGISTERS(X, n) \
+	X(UDR##n) X(UCSR##n##A) X(UCSR##n##B) X(UCSR##n##C) X(UBRR##n##L) X(UBRR##n##H)
+
+#define HOST_REGISTERS(X) \
+	X(DDRA) X(DDRB) X(DDRC) X(DDRG) X(DDRL) \
+	X(PORTA) X(PORTB) X(PORTC) X(PORTG) X(PORTL) \
+	X(PINC) X(TCCR4A) X(TCCR4B) X(TIMSK4) X(SMCR) \
+	HOST_USART_REGISTERS(X, 0) HOST_USART_REGISTERS(X, 1) \
+	HOST_USART_REGISTERS(X, 2) HOST_USART_REGISTERS(X, 3)
+
+#define HOST_DECLARE_REGISTER(name) extern volatile uint8_t name;
+HOST_REGISTERS(HOST_DECLARE_REGISTER)
+
+extern volatile uint16_t OCR4A;
+extern volatile uint16_t *Port_TCNT4(void);
+extern volatile uint8_t *Port_TIFR4(void);
+#define TCNT4 (*Port_TCNT4())
+#define TIFR4 (*Port_TIFR4())
+
+/* TIMER4 */
+#define WGM32   3
+#define WGM42   3
+#define CS42    2
+#define OCIE4A  1
+#define OCF4A   1
+
+/* USARTn, the same bit positions on all four */
+#define HOST_USART_BITS(n) \
+	enum { RXC##n = 7, TXC##n = 6, UDRE##n = 5, FE##n = 4, DOR##n = 3, UPE##n = 2, \
+		U2X##n = 1, MPCM##n = 0, RXCIE##n = 7, TXCIE##n = 6, UDRIE##n = 5, \
+		RXEN##n = 4, TXEN##n = 3, UCSZ##n##2 = 2, RXB8##n = 1, TXB8##n = 0, \
+		UMSEL##n##1 = 7, UMSEL##n##0 = 6, UPM##n##1 = 5, UPM##n##0 = 4, \
+		USBS##n = 3, UCSZ##n##1 = 2, UCSZ##n##0 = 1, UCPOL##n = 0 };
+HOST_USART_BITS(0)
+HOST_USART_BITS(1)
+HOST_USART_BITS(2)
+HOST_USART_BITS(3)
+
+#endif /* HOST_AVR_IO_H */
@@ -0,0 +1,11 @@
+/**
+ * \file pgmspace.h
+ * \brief Host stand-in for <avr/pgmspace.h>: there is only one address space.
+ */
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#endif /* HOST_AVR_PGMSPACE_H */
@@ -0,0 +1,17 @@
+/**
+ * \file sleep.h
+ * \brief Host stand-in for <avr/sleep.h>: sleeping waits for the next signal.
+ */
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+
+extern void Port_Sleep(void);
+
+#define SLEEP_MODE_IDLE 0
+#define set_sleep_mode(mode)
+#define sleep_mode() Port_Sleep()
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() Port_Sleep()
+
+#endif /* HOST_AVR_SLEEP_H */
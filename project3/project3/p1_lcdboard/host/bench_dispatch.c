@@ -0,0 +1,119 @@
+/**
+ * \file bench_dispatch.c
+ * \brief Host benchmark of the kernel's dispatch path
+ *
+ * A single RR task calls Task_Next() in a tight loop, so that every call is
+ * a full trip through the kernel: Enter_Kernel(), requeue, Dispatch() and
+ * Exit_Kernel(). Between rounds it adds BENCH_STEP more periodic tasks which
+ * are never released during the run, so they sit in the kernel's task tables
+ * and release queue. The cost per dispatch should not grow with their number.
+ *
+ * It then times Msg_Send() round trips to a RR server of its own level, one
+ * that answers with Msg_Recv() and Msg_Rply() and one that uses Msg_Rply_Recv(),
+ * while BENCH_PEERS other RR tasks keep calling Task_Next(). A round trip that
+ * has to wait for the peers' turns costs as many more dispatches.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <x86intrin.h>
+#include "../os.h"
+
+#define BENCH_DISPATCHES 1000000L
+#define BENCH_STEP 8
+#define BENCH_ROUND_TRIPS 1000000L
+#define BENCH_PEERS 4
+
+static uint64_t Bench_Now_Ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleeper()
+{
+	for (;;) {
+		Task_Next();
+	}
+}
+
+static void server_rply()
+{
+	unsigned int v;
+	PID from;
+
+	for (;;) {
+		from = Msg_Recv(0xff, &v);
+		Msg_Rply(from, v + 1);
+	}
+}
+
+static void server_rply_recv()
+{
+	unsigned int v;
+	PID from = Msg_Recv(0xff, &v);
+
+	for (;;) {
+		from = Msg_Rply_Recv(from, v + 1, 0xff, &v);
+	}
+}
+
+static void round_trips(const char *server_loop, PID server)
+{
+	uint64_t t0 = Bench_Now_Ns();
+	uint64_t c0 = __rdtsc();
+	unsigned int v = 0;
+	long n;
+
+	for (n = 0; n < BENCH_ROUND_TRIPS; n++) {
+		Msg_Send(server, 1, &v);
+	}
+	printf("%-14s  %13.1f  %17.0f\n", server_loop,
+			(double)(Bench_Now_Ns() - t0) / BENCH_ROUND_TRIPS,
+			(double)(__rdtsc() - c0) / BENCH_ROUND_TRIPS);
+}
+
+static void bench()
+{
+	int tasks = 0;
+	int i;
+	long n;
+
+	printf("periodic tasks  ns/dispatch  cycles/dispatch\n");
+	for (;;) {
+		uint64_t t0 = Bench_Now_Ns();
+		uint64_t c0 = __rdtsc();
+
+		for (n = 0; n < BENCH_DISPATCHES; n++) {
+			Task_Next();
+		}
+		printf("%14d  %11.1f  %15.0f\n", tasks,
+				(double)(Bench_Now_Ns() - t0) / BENCH_DISPATCHES,
+				(double)(__rdtsc() - c0) / BENCH_DISPATCHES);
+
+		if (tasks + BENCH_STEP > MAXPERIODICPROCESS) {
+			break;
+		}
+		for (i = 0; i < BENCH_STEP; i++) {
+			/* staggered, or admission control sees colliding releases */
+			Task_Create_Period(sleeper, 0, 30000, 1, 30000 + tasks + i);
+		}
+		tasks += BENCH_STEP;
+	}
+
+	for (i = 0; i < BENCH_PEERS; i++) {
+		Task_Create_RR(sleeper, 0);
+	}
+	printf("\nserver loop     ns/round trip  cycles/round trip\n");
+	round_trips("Recv + Rply", Task_Create_RR(server_rply, 0));
+	round_trips("Rply_Recv", Task_Create_RR(server_rply_recv, 0));
+	fflush(stdout);
+	exit(0);
+}
+
+void a_main()
+{
+	Task_Create_RR(bench, 0);
+}
@@ -0,0 +1,362 @@
+/**
+ * \file port.c
+ * \brief Host (x86-64 Linux) port of the RTOS
+ *
+ * This file stands in for cswitch.s and the ATmega2560 hardware so that the
+ * unmodified scheduling and message-passing code in os.c runs as a normal
+ * Linux process:
+ *
+ *  - Exit_Kernel()/Enter_Kernel() switch stacks with Port_Switch() (see
+ *    switch_x86_64.S), using KernelSp and CurrentSp exactly like cswitch.s.
+ *  - TIMER4 is emulated in CTC mode from CLOCK_MONOTONIC at the real rate of
+ *    16 us per count, so OCR4A, TCNT4 and OCF4A behave as on the board and
+ *    tickless idle works unchanged. The emulated clock stops while Linux
+ *    does not schedule the process. A 1 ms SIGALRM polls it; when a compare
+ *    match is due and interrupts are enabled, the handler runs the TIMER4
+ *    "ISR", which enters the kernel just like Enter_Kernel_Interrupt.
+ *  - Other device interrupts are emulated by Port_Interrupt(), whose handler
+ *    runs at a later SIGALRM or sei(), after the TIMER4 ISR if both are
+ *    pending.
+ *  - cli()/sei() clear and set an emulated global interrupt flag. Like "reti",
+ *    resuming a task enables interrupts again.
+ *  - UART0 output goes to stdout.
+ *
+ * When the whole system has been idle for HOST_IDLE_EXIT_MS (i.e., no task has
+ * made a kernel call), the process exits, so that test runs terminate.
+ */
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "../os.h"
+#include "../UART/usart.h"
+
+#ifndef HOST_IDLE_EXIT_MS
+#define HOST_IDLE_EXIT_MS 2000  // 0 to never exit
+#endif
+
+#define TIMER_NS_PER_COUNT 16000ULL  // prescaler 256 at 16 MHz
+#define TIMER_POLL_US 1000
+#define TIMER_STALL_NS 5000000ULL    // longer than this between polls, the process was not scheduled
+
+extern volatile unsigned char *KernelSp;
+extern volatile unsigned char *CurrentSp;
+extern volatile uint8_t KernelActive;
+extern volatile uint32_t tick_count;
+extern volatile uint8_t tick_step;
+extern volatile uint8_t kernel_timer_entry;
+
+extern void Port_Switch(volatile unsigned char **save, volatile unsigned char *load);
+extern void Port_Task_Start(void);
+
+#define HOST_DEFINE_REGISTER(name) volatile uint8_t name;
+HOST_REGISTERS(HOST_DEFINE_REGISTER)
+volatile uint16_t OCR4A;
+
+static volatile uint16_t tcnt4;       // what TCNT4 reads as
+static volatile uint16_t tcnt4_read;  // last value the timer put in tcnt4
+static volatile uint8_t tifr4;
+static uint64_t timer_base;           // host time (ns) at which TCNT4 was 0
+static uint64_t timer_last;           // host time of the previous Timer_Advance()
+
+static volatile int irq_enabled;
+static volatile sig_atomic_t port_busy;      // the timer state is being updated
+static volatile sig_atomic_t port_deferred;  // a SIGALRM arrived meanwhile
+
+static void (*volatile device_isr)(void);   // a pending Port_Interrupt()
+
+static volatile unsigned long voluntary_entries;
+
+static uint64_t Host_Now_Ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Brings the emulated TIMER4 up to date: picks up writes to TCNT4, restarts
+ * the count at every compare match (setting OCF4A), and recomputes TCNT4.
+ * Must be called with port_busy set.
+ */
+static void Timer_Advance(void)
+{
+	uint64_t now = Host_Now_Ns();
+	uint64_t period = ((uint64_t)OCR4A + 1) * TIMER_NS_PER_COUNT;
+
+	/* the board does not stop running while Linux runs something else, so
+	 * such a stall would be charged to whichever task was running; freeze the
+	 * emulated clock instead */
+	if (timer_last != 0 && now - timer_last > TIMER_STALL_NS) {
+		timer_base += now - timer_last - TIMER_POLL_US * 1000ULL;
+	}
+	timer_last = now;
+
+	if (tcnt4 != tcnt4_read || !(TCCR4B & (1 << CS42))) {
+		timer_base = now - (uint64_t)tcnt4 * TIMER_NS_PER_COUNT;
+	} else {
+		while (now - timer_base >= period) {
+			timer_base += period;
+			__sync_fetch_and_or(&tifr4, 1 << OCF4A);
+		}
+	}
+	tcnt4 = tcnt4_read = (now - timer_base) / TIMER_NS_PER_COUNT;
+}
+
+static void Timer_Update(void)
+{
+	if (port_busy) {
+		return;
+	}
+	port_busy = 1;
+	Timer_Advance();
+	while (port_deferred) {
+		port_deferred = 0;
+		Timer_Advance();
+	}
+	port_busy = 0;
+}
+
+/**
+ * The TIMER4 compare match ISR, entered with interrupts disabled. It does
+ * what Enter_Kernel_Interrupt and inc_tick_count do in cswitch.s.
+ */
+static void Timer_Interrupt(void)
+{
+	tick_count += tick_step;
+	tick_step = 1;
+	if (KernelActive) {
+		kernel_timer_entry = 1;
+		Port_Switch(&CurrentSp, KernelSp);
+	}
+	irq_enabled = 1;  // reti
+}
+
+/**
+ * Runs the TIMER4 ISR for as long as a compare match is pending and
+ * interrupts are enabled.
+ */
+static void Poll_Timer(void)
+{
+	for (;;) {
+		if (!(tifr4 & (1 << OCF4A)) || !(TIMSK4 & (1 << OCIE4A))) {
+			return;
+		}
+		if (!__sync_bool_compare_and_swap(&irq_enabled, 1, 0)) {
+			return;
+		}
+		if (__sync_fetch_and_and(&tifr4, ~(1 << OCF4A)) & (1 << OCF4A)) {
+			Timer_Interrupt();
+		} else {
+			irq_enabled = 1;
+		}
+	}
+}
+
+/**
+ * Runs the pending interrupts whose turn it is, if interrupts are enabled.
+ */
+static void Poll_Interrupts(void)
+{
+	Poll_Timer();
+	if (device_isr == NULL || !__sync_bool_compare_and_swap(&irq_enabled, 1, 0)) {
+		return;
+	}
+	/* a device ISR does not enter the kernel: it returns with reti */
+	__sync_lock_test_and_set(&device_isr, NULL)();
+	irq_enabled = 1;
+}
+
+static void Alarm_Handler(int sig)
+{
+	(void)sig;
+	if (port_busy) {
+		port_deferred = 1;
+		return;
+	}
+	Timer_Update();
+	Poll_Interrupts();
+}
+
+/**
+ * Makes "isr" a pending device interrupt. Like an interrupt handler on the
+ * board, it runs with interrupts disabled, at the next SIGALRM or sei() at
+ * which they are enabled, and must not enter the kernel.
+ */
+void Port_Interrupt(void (*isr)(void))
+{
+	device_isr = isr;
+}
+
+__attribute__((constructor))
+static void Port_Init(void)
+{
+	struct sigaction sa;
+	struct itimerval it;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = Alarm_Handler;
+	/* the handler may switch to another task and never "return" for a while */
+	sa.sa_flags = SA_NODEFER | SA_RESTART;
+	sigaction(SIGALRM, &sa, NULL);
+
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = TIMER_POLL_US;
+	it.it_value = it.it_interval;
+	setitimer(ITIMER_REAL, &it, NULL);
+}
+
+volatile uint16_t *Port_TCNT4(void)
+{
+	Timer_Update();
+	return &tcnt4;
+}
+
+volatile uint8_t *Port_TIFR4(void)
+{
+	Timer_Update();
+	return &tifr4;
+}
+
+void Port_Cli(void)
+{
+	irq_enabled = 0;
+}
+
+void Port_Sei(void)
+{
+	irq_enabled = 1;
+	Poll_Interrupts();
+}
+
+/**
+ * The idle task's sleep: waits for the next SIGALRM. Exits the process once
+ * nothing but the idle task has run for HOST_IDLE_EXIT_MS.
+ */
+void Port_Sleep(void)
+{
+	static unsigned long seen_entries;
+	static uint64_t idle_since;
+	uint64_t now = Host_Now_Ns();
+
+	if (voluntary_entries != seen_entries || idle_since == 0) {
+		seen_entries = voluntary_entries;
+		idle_since = now;
+	} else if (HOST_IDLE_EXIT_MS && now - idle_since >= HOST_IDLE_EXIT_MS * 1000000ULL) {
+		fflush(stdout);
+		exit(0);
+	}
+	pause();
+}
+
+void Port_Delay_Ms(double ms)
+{
+	usleep((useconds_t)(ms * 1000));
+}
+
+void Port_Abort(unsigned int error, int16_t pid)
+{
+	fflush(stdout);
+	fprintf(stderr, "OS_Abort: error %u", error);
+	if (pid >= 0) {
+		fprintf(stderr, " in task %d", pid);
+	}
+	fprintf(stderr, " at tick %u\n", tick_count);
+	exit(2);
+}
+
+/**
+ * Lays out the initial context of a new task below "top", so that the first
+ * Exit_Kernel() into it "returns" into Port_Task_Start with %rbx = f.
+ */
+unsigned char *Port_Init_Stack(unsigned char *top, voidfuncptr f)
+{
+	uint64_t *sp = (uint64_t *)((uintptr_t)top & ~(uintptr_t)15);
+
+	*--sp = (uint64_t)(uintptr_t)Port_Task_Start;
+	*--sp = 0;                      /* rbp */
+	*--sp = (uint64_t)(uintptr_t)f; /* rbx */
+	*--sp = 0;                      /* r12 */
+	*--sp = 0;                      /* r13 */
+	*--sp = 0;                      /* r14 */
+	*--sp = 0;                      /* r15 */
+	*--sp = 0x037F00001F80ULL;      /* x87 control word, MXCSR defaults */
+	return (unsigned char *)sp;
+}
+
+/*
+ * The two halves of the context switch, as in cswitch.s.
+ */
+void CSwitch(void)
+{
+	Port_Switch(&KernelSp, CurrentSp);
+}
+
+void Exit_Kernel(void)
+{
+	Port_Switch(&KernelSp, CurrentSp);
+}
+
+void Enter_Kernel(void)
+{
+	++voluntary_entries;
+	Port_Switch(&CurrentSp, KernelSp);
+	Port_Sei();  // reti
+}
+
+/*
+ * UART0 is the process's stdout.
+ */
+void uart0_putc(char data)
+{
+	putchar(data);
+	if (data == '\n') {
+		fflush(stdout);
+	}
+}
+
+void uart0_putstr(char *string)
+{
+	while (*string) {
+		uart0_putc(*string++);
+	}
+}
+
+void uart0_puts_p(const char *string)
+{
+	while (*string) {
+		uart0_putc(*string++);
+	}
+}
+
+void uart0_putint(int16_t data)
+{
+	printf("%d", data);
+}
+
+void uart0_putuint(uint16_t data)
+{
+	printf("%u", data);
+}
+
+void uart0_putlong(int32_t data)
+{
+	printf("%ld", (long)data);
+}
+
+void uart0_putulong(uint32_t data)
+{
+	printf("%lu", (unsigned long)data);
+}
+
+void uart0_puthex(uint8_t data)
+{
+	printf("%02x", data);
+}
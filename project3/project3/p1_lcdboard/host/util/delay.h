@@ -0,0 +1,12 @@
+/**
+ * \file delay.h
+ * \brief Host stand-in for <util/delay.h>
+ */
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+extern void Port_Delay_Ms(double ms);
+
+#define _delay_ms(ms) Port_Delay_Ms(ms)
+
+#endif /* HOST_UTIL_DELAY_H */
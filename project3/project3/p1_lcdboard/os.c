@@ -4,6 +4,8 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
 #include "os.h"
 #include "UART/usart.h"
 
@@ -37,14 +39,211 @@
 //Comment out the following line to remove debugging code from compiled version.
 // #define DEBUG
 
-#define WORKSPACE 256
+// Task slots and stack memory. Each of these can be overridden from the
+// project's compiler symbols to match what the application actually creates.
+#ifndef MAXPROCESS
 #define MAXPROCESS 4
+#endif
+#ifndef MAXSYSTEMPROCESS
+#define MAXSYSTEMPROCESS MAXPROCESS
+#endif
+#ifndef MAXRRPROCESS
+#define MAXRRPROCESS MAXPROCESS
+#endif
+#ifndef MAXPERIODICPROCESS
 #define MAXPERIODICPROCESS 10
-#define MAXTHREADS MAXPROCESS * 2 + MAXPERIODICPROCESS + 1
+#endif
+#define MAXTHREADS MAXSYSTEMPROCESS + MAXRRPROCESS + MAXPERIODICPROCESS + 1
+
+// A PID is a PD's slot in pid_to_pd in its low PID_SLOT_BITS bits, and the
+// generation of the slot above them. The generation goes up each time a task
+// is created in the slot, so a PID goes stale when its task dies, and the
+// kernel can tell in O(1) (see Pid_Lookup()). It wraps after 255 tasks.
+#define PID_SLOT_BITS 8
+#define PID_SLOT_MASK ((1 << PID_SLOT_BITS) - 1)
+#define PID_SLOTS (MAXTHREADS + 2)  // the tasks, idle, the LWT runner and the timer task
+#if PID_SLOTS > PID_SLOT_MASK + 1
+#error "too many task slots for PID_SLOT_BITS"
+#endif
+
+// all task stacks are carved out of one arena of STACK_ARENA_SIZE bytes
+#ifndef STACK_ARENA_SIZE
+#define STACK_ARENA_SIZE 3072
+#endif
+// interrupt handlers run on the stack of the task they interrupt, so every
+// task stack, STACK_MIN included, must also hold TIMER4's full register save
+#ifndef STACK_MIN
+#define STACK_MIN 64          // smallest stack a task can be given, in bytes
+#endif
+#ifndef IDLE_STACK
+#define IDLE_STACK 96         // stack of the idle task, in bytes
+#endif
 
 // testing flag, comment out if not testing
 //#define TESTING 1
 
+// tickless idle: while only the idle task is runnable, TIMER4 is reprogrammed
+// to fire at the next periodic release instead of every TICK.
+// Comment out to keep a fixed TICK interrupt.
+#define TICKLESS_IDLE
+
+// stack checking: every task stack is filled with STACK_FILL when created and
+// guarded by STACK_CANARY_SIZE canary bytes at its bottom, which are checked
+// on every context switch. Comment out to skip the check.
+#define STACK_CHECK
+
+#define STACK_FILL 0xA5
+#define STACK_CANARY 0x5A
+#define STACK_CANARY_SIZE 2
+
+// context-switch trace: every switch in and out of a task is recorded in an
+// in-RAM ring buffer of TRACE_SIZE records (see OS_Trace_Drain()).
+// Comment out to remove the tracing code.
+#define KERNEL_TRACE
+
+#define TRACE_SIZE 32  // number of trace records, must be a power of 2
+
+// admission control: Task_Create_Period() refuses a task that would make the
+// periodic task set infeasible, returning 0 and leaving UTILIZATION_EXCEEDED
+// or RELEASE_COLLISION for Task_Admission_Error(). Comment out to accept any
+// parameters.
+#define ADMISSION_CONTROL
+
+#define UTILIZATION_ONE 0x8000  // fixed-point 1.0 for utilization sums
+
+// cyclic executive: periodic tasks are released from a table that covers one
+// major frame (the hyperperiod) in minor frames of one TICK, instead of from
+// the release queue. Periods longer than CYCLIC_FRAMES must be multiples of
+// the major frame. Uncomment to use.
+//#define CYCLIC_EXECUTIVE
+
+#ifndef CYCLIC_FRAMES
+#define CYCLIC_FRAMES 60  // longest major frame, in TICKs
+#endif
+
+// scheduling policy among periodic tasks:
+//  PERIODIC_FIFO  jobs run in release order and must be conflict-free; a job
+//                 still running wcet TICKs after its release aborts the RTOS
+//                 (with a wcet of 0, still running at its next release)
+//  PERIODIC_EDF   earliest deadline first
+//  PERIODIC_RM    rate monotonic, i.e., the shorter period first
+// Under EDF and RM, overlapping jobs preempt each other at TICK boundaries
+// and only a job still running at its next release (its deadline) aborts.
+#define PERIODIC_FIFO 0
+#define PERIODIC_EDF  1
+#define PERIODIC_RM   2
+
+#ifndef PERIODIC_POLICY
+#define PERIODIC_POLICY PERIODIC_FIFO
+#endif
+
+// mailboxes: Msg_ASend() leaves a message that its receiver is not waiting
+// for in the receiver's mailbox of MAILBOX_DEPTH messages, which Msg_Recv()
+// drains before it blocks. Comment out to make such a Msg_ASend() a no-op.
+#define MAILBOXES
+
+#ifndef MAILBOX_DEPTH
+#define MAILBOX_DEPTH 4
+#endif
+
+// direct handoff: a task woken up by Msg_Send(), Msg_Rply() or
+// Msg_Rply_Recv() is switched to straight away, ahead of its peers, instead of
+// going through its ready queue. Comment out to queue it like any other task.
+#define DIRECT_HANDOFF
+
+// buffer pool: BUF_COUNT buffers of BUF_SIZE bytes (see os.h) that tasks lend
+// each other with Msg_Send_Buf(), instead of copying their contents.
+// Comment out to leave the pool and its API out of the kernel.
+#define BUFFER_POOL
+
+#ifndef BUF_COUNT
+#define BUF_COUNT 8
+#endif
+
+// mutexes and semaphores: MAXMUTEX mutexes with priority inheritance and
+// MAXSEMAPHORE counting semaphores (see Mutex_Init() and Sem_Init()).
+// Comment out to leave them out of the kernel.
+#define SYNC_OBJECTS
+
+#ifndef MAXMUTEX
+#define MAXMUTEX 4
+#endif
+#ifndef MAXSEMAPHORE
+#define MAXSEMAPHORE 4
+#endif
+
+// event groups: MAXEVENTGROUP groups of event flags, which tasks wait on for
+// any or all of a set of bits, and which tasks set with Event_Set() and
+// interrupt handlers with Event_Set_ISR() (see Event_Init()). Comment out
+// to leave them out of the kernel.
+#define EVENT_GROUPS
+
+#ifndef MAXEVENTGROUP
+#define MAXEVENTGROUP 4
+#endif
+
+// what to do about a periodic job that breaks its timing (see
+// Task_Overrun_Policy()) unless its task says otherwise
+#ifndef OVERRUN_DEFAULT
+#define OVERRUN_DEFAULT OVERRUN_ABORT
+#endif
+
+// execution-time statistics: every switch in and out of a task is timestamped
+// with Now_us(), and each task's job times, preemptions, overruns and missed
+// deadlines are kept for Task_Stats(). It costs every context switch two
+// Now_us() calls and a few 32- and 64-bit sums, and every task 40 bytes of RAM.
+// Uncomment to use.
+//#define EXEC_STATS
+
+// lightweight tasks: up to MAXLWT periodic protothreads (see
+// Lwt_Create_Period()) that share the LWT_STACK-byte stack of a single
+// runner task. Comment out to leave them out of the kernel.
+#define LIGHTWEIGHT_TASKS
+
+#ifndef MAXLWT
+#define MAXLWT 16
+#endif
+#ifndef LWT_STACK
+#define LWT_STACK 128
+#endif
+
+// shared job stacks: the periodic tasks made with Task_Create_Job() run one
+// job per call of their function, and all those of one preemption level
+// share one JOB_STACK-byte stack (see Job_Enter()), out of MAXJOBSTACKS.
+// Comment out to leave them out of the kernel.
+#define JOB_STACKS
+
+#ifndef MAXJOBSTACKS
+#define MAXJOBSTACKS 4
+#endif
+#ifndef JOB_STACK
+#define JOB_STACK WORKSPACE
+#endif
+
+// software timers: up to MAXSOFTTIMER one-shot or auto-reload timers (see
+// Soft_Timer_Create()) on a hashed wheel of TIMER_WHEEL_SIZE one-TICK slots.
+// Their callbacks run in a System task with a SOFT_TIMER_STACK-byte stack.
+// Comment out to leave them out of the kernel.
+#define SOFT_TIMERS
+
+#ifndef MAXSOFTTIMER
+#define MAXSOFTTIMER 8   // at most 16
+#endif
+#ifndef TIMER_WHEEL_SIZE
+#define TIMER_WHEEL_SIZE 16   // a power of 2
+#endif
+#ifndef SOFT_TIMER_STACK
+#define SOFT_TIMER_STACK 128
+#endif
+
+// frame marker and size of the short (callee-saved) context in cswitch.s
+#define FRAME_SHORT 0
+#define CALLEE_SAVED_REGS 18
+
+#define TIMER_TICK_TOP 624                                  // OCR4A for one TICK of 625 counts
+#define TIMER_US_PER_COUNT 16                               // one TIMER4 count, in microseconds
+#define TICKLESS_MAX_TICKS (0xFFFF / (TIMER_TICK_TOP + 1))  // longest TIMER4 can sleep
+
 /*===========
   * RTOS Internal
   *===========
@@ -67,6 +266,16 @@
 extern void CSwitch();
 extern void Exit_Kernel(); /* this is the same as CSwitch() */
 
+#ifdef OS_HOST
+/**
+  * The host build (see host/port.c) replaces cswitch.s and TIMER4. It lays
+  * out a new task's initial context below "top" and returns its stack
+  * pointer, and it handles OS_Abort() by reporting the error and exiting.
+  */
+extern unsigned char *Port_Init_Stack(unsigned char *top, voidfuncptr f);
+extern void Port_Abort(unsigned int error, int16_t pid);
+#endif
+
 #ifdef TESTING
 extern void test_main();
 #endif
@@ -78,7 +287,6 @@ extern void a_main();
 
 /* Prototype */
 void Task_Terminate(void);
-int Match_Send(PID id, MTYPE t);
 
 /** 
   * This external function could be implemented in two ways:
@@ -93,8 +301,8 @@ int Match_Send(PID id, MTYPE t);
   */
 extern void Enter_Kernel();
 
-#define Disable_Interrupt() asm volatile("cli" ::)
-#define Enable_Interrupt() asm volatile("sei" ::)
+#define Disable_Interrupt() cli()
+#define Enable_Interrupt() sei()
 
 /**
   *  This is the set of states that a task can be in at any given time.
@@ -106,15 +314,41 @@ typedef enum process_states {
 	SUSPENDED,
 	SNDBLOCK,
 	RCVBLOCK,
-	RPYBLOCK
+	RPYBLOCK,
+	MTXBLOCK,
+	SEMBLOCK,
+	EVTBLOCK,
+	SLEEPING
 } PROCESS_STATES;
 
+/**
+  * Whether a task is in the timer queue, and how its last wait failed: by
+  * running out of time, or because the task it was sending to terminated.
+  */
+typedef enum timer_states {
+	TIMER_OFF = 0,
+	TIMER_ARMED,
+	TIMER_EXPIRED,
+	TIMER_ABANDONED
+} TIMER_STATES;
+
 typedef enum error_types {
 	NO_ERROR = 0,
 	TOO_MANY_TASKS,
 	WCET_EXCEEDED,
 	PID_NOT_FOUND,
-	QUEUE_SPACE_EXCEEDED
+	QUEUE_SPACE_EXCEEDED,
+	STACK_OVERFLOW,
+	STACK_ARENA_EXHAUSTED,
+	UTILIZATION_EXCEEDED,
+	RELEASE_COLLISION,
+	CYCLIC_TABLE_OVERFLOW,
+	DEADLINE_MISSED,
+	BUFFER_NOT_OWNED,
+	SYNC_NOT_FOUND,
+	MUTEX_NOT_OWNED,
+	MUTEX_RELOCKED,
+	JOB_BLOCKED
 } ERROR_TYPES;
 
 /**
@@ -135,41 +369,312 @@ typedef enum priority_levels {
     SYSTEM
 } PRIORITY_LEVELS;
 
+#ifdef MAILBOXES
+/**
+  * A message sent with Msg_ASend() while its receiver was not waiting for it.
+  */
+typedef struct Mail
+{
+	MTYPE type;
+	unsigned int msg;
+} MAIL;
+#endif
+
+/**
+  * A FIFO of process descriptors, linked through PD.next. Used for the
+  * per-priority ready queues, the periodic release queue and the queues of
+  * blocked senders.
+  */
+typedef struct PDQueue
+{
+	struct ProcessDescriptor *head;
+	struct ProcessDescriptor *tail;
+} PD_QUEUE;
+
 /**
   * Each task is represented by a process descriptor, which contains all
-  * relevant information about this task. For convenience, we also store
-  * the task's stack, i.e., its workspace, in here.
+  * relevant information about this task. Its stack, i.e., its workspace,
+  * is allocated from the stack arena when the task is first created.
   */
 typedef struct ProcessDescriptor
 {
     unsigned char *sp; /* stack pointer into the "workSpace" */
-    unsigned char workSpace[WORKSPACE];
+    unsigned char *workSpace; /* the task's stack, allocated from stack_arena */
+    unsigned int stack_size; /* size of workSpace in bytes */
     PROCESS_STATES state;
     PRIORITY_LEVELS priority;
+    PRIORITY_LEVELS level; /* level it is queued at; above priority while it holds
+                              a mutex that a higher level task is waiting for */
     voidfuncptr code; /* function to be executed as a task */
     KERNEL_REQUEST_TYPE request;
     uint16_t pid;
 	TICK period;
 	TICK wcet;
 	TICK offset;
-	TICK run_length;
-	int16_t time_until_run;
-	TICK last_check_time;
+	TICK release;       /* tick at which the current job was released */
+	TICK next_release;  /* tick at which the next job will be released */
+#ifdef CYCLIC_EXECUTIVE
+	uint16_t cycles;       /* releases every this many visits of its table frames */
+	uint16_t cycles_left;  /* visits left until the next release */
+#endif
 	uint16_t msg_pid;
 	MTYPE mask;
 	int msg;
 	int arg;
+	PD_QUEUE senders;  /* tasks SNDBLOCKed on this one, in the order they sent */
+#ifdef MAILBOXES
+	MAIL mailbox[MAILBOX_DEPTH];  /* undelivered Msg_ASend() messages, oldest first */
+	uint8_t mail_count;
+	uint16_t mail_dropped;        /* Msg_ASend() messages lost to a full mailbox */
+#endif
+#ifdef BUFFER_POOL
+	void *buf;  /* pool buffer lent with the message in msg, or NULL */
+#endif
+#ifdef SYNC_OBJECTS
+	struct Mutex *held;        /* mutexes it owns, linked through Mutex.next_held */
+	struct Mutex *blocked_on;  /* mutex it is MTXBLOCKed on */
+#endif
+#ifdef EVENT_GROUPS
+	unsigned int events;  /* bits it is EVTBLOCKed on; then the flags that woke it */
+	uint8_t event_mode;   /* Event_Wait()'s "mode" */
+#endif
+	OVERRUN_POLICY overrun;
+	uint16_t violations;   /* timing violations it has been let off with */
+	uint8_t skipped;       /* its current job has already skipped a release */
+#ifdef JOB_STACKS
+	struct JobStack *job;  /* stack it shares, if made by Task_Create_Job() */
+	unsigned char *own_workSpace;  /* the PD's own stack, set aside while it shares one */
+	unsigned int own_stack_size;
+#endif
+#ifdef EXEC_STATS
+	TASK_STATS stats;
+	uint64_t exec_total;   /* sum of the job times in stats.jobs, in us */
+	uint32_t job_us;       /* time the current job has run so far */
+	uint32_t switched_in;  /* Now_us() when it last got the CPU */
+#endif
+	TIMER_STATES timer;
+	TICK delta;  /* TICKs after the previous task in the timer queue that it wakes up */
+	struct ProcessDescriptor *timer_next;  /* link in the timer queue */
+	struct ProcessDescriptor *next; /* link in a ready, release or senders queue */
 } PD;
 
+#ifdef SYNC_OBJECTS
+/**
+  * Tasks blocked on a mutex or a semaphore: one FIFO per priority level, so
+  * that, as with the ready queues, the highest waiter is found in constant
+  * time. Bit n of levels is set iff queue[n] is non-empty.
+  */
+typedef struct WaitQueue
+{
+	PD_QUEUE queue[SYSTEM + 1];
+	uint8_t levels;
+} WAIT_QUEUE;
+
+typedef struct Mutex
+{
+	PD *owner;                 /* NULL while unlocked */
+	WAIT_QUEUE waiters;
+	struct Mutex *next_held;
+} MUTEX_CB;
+
+typedef struct Semaphore
+{
+	unsigned int count;
+	WAIT_QUEUE waiters;
+} SEMAPHORE_CB;
+#endif
+
+#ifdef EVENT_GROUPS
+/**
+  * Every waiter has a wait of its own, and all of those that a new flag
+  * satisfies wake up together, so they simply queue in FIFO order.
+  */
+typedef struct EventGroup
+{
+	unsigned int flags;
+	PD_QUEUE waiters;
+} EVENT_GROUP_CB;
+#endif
+
+#ifdef JOB_STACKS
+/**
+  * The stack shared by the Task_Create_Job() tasks of one preemption level.
+  * At most one job at a time is under way on it, its owner; jobs of the
+  * same level never preempt each other, so the owner only has to be let
+  * finish when it has been preempted by a higher level.
+  */
+typedef struct JobStack
+{
+	TICK level;  /* the tasks' period, or 0 if periodic jobs never preempt each other */
+	unsigned char *workSpace;
+	PD *owner;   /* task whose job is under way, or NULL */
+} JOB_STACK_CB;
+#endif
+
+#ifdef SOFT_TIMERS
+#if MAXSOFTTIMER > 16
+#error "MAXSOFTTIMER must fit in soft_timers_due"
+#endif
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+
+/**
+  * A software timer. While armed, it is in the list of wheel slot "slot",
+  * and expires when that slot comes round with "rounds" at 0.
+  */
+typedef struct SoftTimer
+{
+	timerfuncptr code;  /* NULL while free */
+	int arg;
+	TICK period;
+	uint8_t mode;
+	uint8_t armed;
+	uint8_t slot;
+	uint16_t rounds;    /* turns of the wheel still to go */
+	struct SoftTimer *prev;
+	struct SoftTimer *next;
+} SOFT_TIMER_CB;
+#endif
+
 /**
   * This table contains ALL process descriptors. It doesn't matter what
   * state a task is in.
   */
-static PD round_robin_tasks[MAXPROCESS];
-static PD system_tasks[MAXPROCESS];
+static PD round_robin_tasks[MAXRRPROCESS];
+static PD system_tasks[MAXSYSTEMPROCESS];
 static PD periodic_tasks[MAXPERIODICPROCESS];
 static PD idle_task;
-static PD *pid_to_pd[MAXPROCESS * 3 + 10] = {NULL};
+static PD *pid_to_pd[PID_SLOTS];  /* every PD, by slot; see PID_SLOT_BITS */
+
+/**
+  * Every task stack comes out of this arena. It lives in .noinit, since the
+  * C runtime does not need to clear it: each stack is filled when its task
+  * is created. Stacks are handed out from the bottom up and stay with the
+  * PD slot they were first given to; a later task created in the same slot
+  * reuses the stack if it is large enough.
+  */
+static unsigned char stack_arena[STACK_ARENA_SIZE] __attribute__((section(".noinit")));
+static unsigned int stack_arena_used;
+
+#ifdef BUFFER_POOL
+/**
+  * Buffers for Msg_Send_Buf(). Each one belongs to exactly one task at a
+  * time, or to nobody while buf_owner is NULL; only its owner may touch it.
+  */
+static unsigned char buf_pool[BUF_COUNT][BUF_SIZE];
+static PD *buf_owner[BUF_COUNT];
+#endif
+
+#ifdef JOB_STACKS
+static JOB_STACK_CB job_stacks[MAXJOBSTACKS];
+static uint8_t job_stack_count;
+#endif
+
+#ifdef SYNC_OBJECTS
+/** handed out by Mutex_Init() and Sem_Init(); handle n is entry n - 1 */
+static MUTEX_CB mutexes[MAXMUTEX];
+static uint8_t mutex_count;
+static SEMAPHORE_CB semaphores[MAXSEMAPHORE];
+static uint8_t semaphore_count;
+#endif
+
+#ifdef EVENT_GROUPS
+#if MAXEVENTGROUP > 8
+#error "MAXEVENTGROUP must fit in events_posted"
+#endif
+/** handed out by Event_Init(); handle n is entry n - 1 */
+static EVENT_GROUP_CB event_groups[MAXEVENTGROUP];
+static uint8_t event_group_count;
+/** bit n is set while group n has flags from Event_Set_ISR() its waiters have not seen */
+static volatile uint8_t events_posted;
+#endif
+
+/**
+  * One ready queue per priority level, indexed by PRIORITY_LEVELS. The idle
+  * task is never queued; it runs whenever all of the queues are empty.
+  * Bit n of ready_levels is set iff ready_queue[n] is non-empty, so the
+  * highest ready level is a single table lookup.
+  */
+static PD_QUEUE ready_queue[SYSTEM + 1];
+static uint8_t ready_levels;
+static const uint8_t highest_level[1 << (SYSTEM + 1)] = {
+	IDLE, IDLE, ROUND_ROBIN, ROUND_ROBIN,
+	PERIODIC, PERIODIC, PERIODIC, PERIODIC,
+	SYSTEM, SYSTEM, SYSTEM, SYSTEM,
+	SYSTEM, SYSTEM, SYSTEM, SYSTEM
+};
+
+#ifndef CYCLIC_EXECUTIVE
+/**
+  * SUSPENDED periodic tasks, sorted by next_release. Dispatch() only ever
+  * looks at the head.
+  */
+static PD_QUEUE release_queue;
+#else
+#if MAXPERIODICPROCESS <= 8
+typedef uint8_t CYCLIC_MASK;
+#elif MAXPERIODICPROCESS <= 16
+typedef uint16_t CYCLIC_MASK;
+#elif MAXPERIODICPROCESS <= 32
+typedef uint32_t CYCLIC_MASK;
+#else
+typedef uint64_t CYCLIC_MASK;
+#endif
+
+/**
+  * The cyclic executive's release table: bit x of cyclic_table[f] is set if
+  * periodic_tasks[x] may be released in minor frame f. Frame cyclic_frame
+  * is TICK cyclic_tick, the last one whose releases have been made.
+  */
+static CYCLIC_MASK cyclic_table[CYCLIC_FRAMES];
+static TICK cyclic_major;  /* frames in the major frame, 0 if the table is empty */
+static TICK cyclic_frame;
+static TICK cyclic_tick;
+#endif
+
+/**
+  * Sleeping tasks and tasks in a timed wait, as a delta list: each one wakes
+  * up "delta" TICKs after the one before it, and the head "delta" TICKs
+  * after timer_base. Expiring timers therefore only ever looks at the head.
+  */
+static PD *timer_head;
+static TICK timer_base;
+
+#ifdef LIGHTWEIGHT_TASKS
+/**
+  * The control blocks of the lightweight tasks, free while "code" is NULL,
+  * and the runner task whose stack they all run on. lwt_queue holds the
+  * LWTs waiting for a release, sorted by release; the runner sleeps until
+  * the release of the head.
+  */
+static LWT lwts[MAXLWT];
+static LWT *lwt_queue;
+static PD lwt_runner;
+#endif
+
+#ifdef SOFT_TIMERS
+/**
+  * Software timers, handed out by Soft_Timer_Create() (handle n is entry
+  * n - 1), and the wheel they are armed on: slot n lists the timers that
+  * expire on a TICK that is n modulo TIMER_WHEEL_SIZE. wheel_tick is the
+  * last TICK whose slot has been expired. Bit n of soft_timers_due is set
+  * while the callback of timer n waits for the timer task to run it.
+  */
+static SOFT_TIMER_CB soft_timers[MAXSOFTTIMER];
+static uint8_t soft_timer_count;
+static uint8_t soft_timers_armed;
+static SOFT_TIMER_CB *timer_wheel[TIMER_WHEEL_SIZE];
+static TICK wheel_tick;
+static volatile uint16_t soft_timers_due;
+static PD timer_task;
+#endif
+
+#ifdef DIRECT_HANDOFF
+/**
+  * A READY task that is in no ready queue: the one the current kernel request
+  * hands the CPU to, unless a task of a higher level is ready.
+  */
+static PD *handoff;
+#endif
 
 /**
   * The process descriptor of the currently RUNNING task.
@@ -193,584 +698,3104 @@ volatile unsigned char *KernelSp;
   */
 volatile unsigned char *CurrentSp;
 
-/** index to next task to run */
-volatile static unsigned int NextP_RR;
-volatile static unsigned int NextP_Per;
-volatile static unsigned int NextP_Sys;
-
 /** 1 if kernel has been started; 0 otherwise. */
 // this variable is not static so it is accessible from assembly - the user code
 // should not attempt to touch this variable
 volatile uint8_t KernelActive;
 
-// index of pids used so far
-static volatile uint16_t pid_index;
+// number of TICKs passed so far since OS start; the kernel only uses the
+// low 16 bits, see Ticks()
+volatile uint32_t tick_count;
 
-// number of TICKs passed so far since OS start - wraps around at 65535
-volatile uint16_t tick_count;
-
-/** number of tasks created so far */
-volatile static unsigned int Tasks;
+// number of TICKs the next TIMER4 compare match accounts for; inc_tick_count
+// in cswitch.s adds it to tick_count and resets it to 1
+volatile uint8_t tick_step = 1;
 
 /**
- * When creating a new task, it is important to initialize its stack just like
- * it has called "Enter_Kernel()"; so that when we switch to it later, we
- * can just restore its execution context on its stack.
- * (See file "cswitch.S" for details.)
- */
-void Kernel_Create_Task_At(PD *p, voidfuncptr f, uint16_t pid)
+  * The current TICK, for the kernel's own wrap-safe TICK arithmetic. Only
+  * for code that runs with interrupts disabled.
+  */
+static TICK Ticks()
 {
-	pid_to_pd[pid] = p;
-    unsigned char *sp;
+	return (TICK)tick_count;
+}
 
-    //Changed -2 to -1 to fix off by one error.
-    sp = (unsigned char *)&(p->workSpace[WORKSPACE - 1]);
+#ifdef TICKLESS_IDLE
+// TRUE while TIMER4 is programmed for more than one TICK
+static uint8_t tickless_active;
+#endif
 
-    /*----BEGIN of NEW CODE----*/
-    //Initialize the workspace (i.e., stack) and PD here!
+/** number of tasks created so far */
+volatile static unsigned int Tasks;
 
-    //Clear the contents of the workspace
-    memset(&(p->workSpace), 0, WORKSPACE);
+// set by the TIMER4 interrupt path in cswitch.s when it enters the kernel,
+// i.e., when Cp has been preempted rather than making a request; the kernel
+// clears it once it has looked at it
+volatile uint8_t kernel_timer_entry;
 
-    //Notice that we are placing the address (16-bit) of the functions
-    //onto the stack in reverse byte order (least significant first, followed
-    //by most significant).  This is because the "return" assembly instructions
-    //(rtn and rti) pop addresses off in BIG ENDIAN (most sig. first, least sig.
-    //second), even though the AT90 is LITTLE ENDIAN machine.
+#ifdef ADMISSION_CONTROL
+// why admission control refused the last periodic task, or NO_ERROR
+static ERROR_TYPES admission_error;
+#endif
 
-    //Store terminate at the bottom of stack to protect against stack underrun.
-    *(unsigned char *)sp-- = ((unsigned int)Task_Terminate) & 0xff;
-    *(unsigned char *)sp-- = (((unsigned int)Task_Terminate) >> 8) & 0xff;
-    *(unsigned char *)sp-- = 0;
+#ifdef KERNEL_TRACE
+/**
+  * One trace record. "event" is TRACE_IN when the task is switched in, or
+  * TRACE_OUT plus the reason it left: its KERNEL_REQUEST_TYPE, or
+  * TRACE_TIMER if TIMER4 preempted it.
+  */
+typedef struct TraceRecord
+{
+	uint16_t tick;  /* tick_count at the switch */
+	uint16_t tcnt;  /* TCNT4 at the switch, 16 us per count */
+	uint16_t pid;
+	uint8_t event;
+} TRACE_RECORD;
+
+#define TRACE_IN    0x00
+#define TRACE_OUT   0x80
+#define TRACE_TIMER 0x7F
+
+static TRACE_RECORD trace_buffer[TRACE_SIZE];
+static volatile uint8_t trace_head;  /* next record to write */
+static volatile uint8_t trace_tail;  /* oldest record not yet drained */
+static volatile uint16_t trace_dropped;  /* records overwritten before being drained */
+static PID trace_drain_pid;  /* the task running OS_Trace_Drain(), which is not traced */
+#endif
 
-    //Place return address of function at bottom of stack
-    *(unsigned char *)sp-- = ((unsigned int)f) & 0xff;
-    *(unsigned char *)sp-- = (((unsigned int)f) >> 8) & 0xff;
-    *(unsigned char *)sp-- = 0;
+/** PID shown on PORTB by OS_Abort(), or -1 if the error is not tied to a task */
+static int16_t abort_pid = -1;
 
-    //Place stack pointer at top of stack
-    sp = sp - 33;
+/*===========
+  * Ready and release queues
+  *===========
+  */
 
-    p->sp = sp;  /* stack pointer into the "workSpace" */
-    p->code = f; /* function to be executed as a task */
-    p->pid = pid;
+static void Queue_Push_Back(PD_QUEUE *q, PD *p)
+{
+	p->next = NULL;
+	if (q->tail == NULL) {
+		q->head = p;
+	} else {
+		q->tail->next = p;
+	}
+	q->tail = p;
+}
 
-    /*----END of NEW CODE----*/
+static void Queue_Push_Front(PD_QUEUE *q, PD *p)
+{
+	p->next = q->head;
+	q->head = p;
+	if (q->tail == NULL) {
+		q->tail = p;
+	}
+}
 
-	
-    
-	
-	if(p->priority == PERIODIC) {
-		p->request = WAITING;
-		p->state = SUSPENDED;
+#if !defined(CYCLIC_EXECUTIVE) || PERIODIC_POLICY != PERIODIC_FIFO
+/**
+  * Inserts p after prev, or at the head if prev is NULL.
+  */
+static void Queue_Insert(PD_QUEUE *q, PD *prev, PD *p)
+{
+	if (prev == NULL) {
+		Queue_Push_Front(q, p);
 	} else {
-		p->request = NONE;
-		p->state = READY;
+		p->next = prev->next;
+		prev->next = p;
+		if (q->tail == prev) {
+			q->tail = p;
+		}
 	}
 }
+#endif
 
 /**
-  *  Create a new task
+  * Unlinks p, which follows prev (or is the head if prev is NULL), from q.
   */
-static void Kernel_Create_Task(voidfuncptr f, unsigned int priority, uint16_t pid)
+static void Queue_Remove(PD_QUEUE *q, PD *prev, PD *p)
 {
-    int x;
-    PD *queue;
-	int maxlength;
+	if (prev == NULL) {
+		q->head = p->next;
+	} else {
+		prev->next = p->next;
+	}
+	if (q->tail == p) {
+		q->tail = prev;
+	}
+	p->next = NULL;
+}
 
-    switch (priority)
-    {
-	case IDLE:
-		idle_task.priority = IDLE;
-		Kernel_Create_Task_At(&idle_task, f, pid);
-		maxlength = MAXPROCESS;
-		return;
-    case ROUND_ROBIN:
-        queue = round_robin_tasks;
-		maxlength = MAXPERIODICPROCESS;
-        break;
-    case PERIODIC:
-        queue = periodic_tasks;
-		maxlength = MAXPROCESS;
-        break;
-    case SYSTEM:
-        queue = system_tasks;
-		maxlength = MAXPROCESS;
-        break;
-    default:
-        queue = round_robin_tasks;
-		maxlength = MAXPROCESS;
-        break;
-    }
+/**
+  * Unlinks p from q, which must contain it, and clears bit "level" of
+  * *levels if that empties q.
+  */
+static void Queue_Unlink(PD_QUEUE *q, uint8_t *levels, uint8_t level, PD *p)
+{
+	PD *prev = NULL;
+	PD *cur;
 
-    if (Tasks >= MAXTHREADS) {
-		OS_Abort(TOO_MANY_TASKS);
+	for (cur = q->head; cur != p; cur = cur->next) {
+		prev = cur;
 	}
+	Queue_Remove(q, prev, p);
+	if (q->head == NULL) {
+		*levels &= ~(1 << level);
+	}
+}
 
-    /* find a DEAD PD that we can use  */
-    for (x = 0; x < maxlength; x++)
-    {
-        if (queue[x].state == DEAD)
-            break;
-    }
-	
-	if(queue[x].state != DEAD)
-		OS_Abort(QUEUE_SPACE_EXCEEDED);
-	
-	queue[x].priority = priority;
-
-    ++Tasks;
-    Kernel_Create_Task_At(&(queue[x]), f, pid);
-}
-
-static void check_states(){
-	for (int i = 0; i < MAXPROCESS; i++){
-		if (pid_to_pd[i] != NULL){
-			PD *p = pid_to_pd[i];
-			if (p->state == SNDBLOCK){
-				if (Match_Send(p->msg_pid, (MTYPE)p->mask)){
-					PD *q = pid_to_pd[p->msg_pid];
-					q->msg_pid = i;
-					q->msg = p->msg;
-					q->state = READY;
-					p->state = RPYBLOCK;
-					q->request = NONE;
-					p->request = WAITING;
-				}
-			}
+static PD *Queue_Pop(PD_QUEUE *q)
+{
+	PD *p = q->head;
+	if (p != NULL) {
+		q->head = p->next;
+		if (q->head == NULL) {
+			q->tail = NULL;
 		}
+		p->next = NULL;
 	}
+	return p;
 }
 
+#if PERIODIC_POLICY != PERIODIC_FIFO
+/**
+  * TRUE if a job of a runs before one of b: a has the earlier deadline (EDF)
+  * or the shorter period (RM).
+  */
+static uint8_t Periodic_Before(PD *a, PD *b)
+{
+#if PERIODIC_POLICY == PERIODIC_EDF
+	return (int16_t)((a->release + a->period) - (b->release + b->period)) < 0;
+#else
+	return a->period < b->period;
+#endif
+}
+
+/**
+  * Inserts p into the PERIODIC ready queue, which is kept in policy order.
+  * p goes behind the jobs it ties with, or ahead of them if "front".
+  */
+static void Periodic_Insert(PD *p, uint8_t front)
+{
+	PD *prev = NULL;
+	PD *cur = ready_queue[PERIODIC].head;
+
+	while (cur != NULL && (front ? Periodic_Before(cur, p) : !Periodic_Before(p, cur))) {
+		prev = cur;
+		cur = cur->next;
+	}
+	Queue_Insert(&ready_queue[PERIODIC], prev, p);
+}
+#endif
+
+/**
+  * Makes p READY and appends it to the ready queue of its level.
+  */
+static void Ready(PD *p)
+{
+	p->state = READY;
+	if (p->level != p->priority) {
+		/* it holds up a higher level task: run it before its new peers */
+		Queue_Push_Front(&ready_queue[p->level], p);
+		ready_levels |= (1 << p->level);
+		return;
+	}
+#if PERIODIC_POLICY != PERIODIC_FIFO
+	if (p->priority == PERIODIC) {
+		Periodic_Insert(p, FALSE);
+		ready_levels |= (1 << PERIODIC);
+		return;
+	}
+#endif
+	Queue_Push_Back(&ready_queue[p->level], p);
+	ready_levels |= (1 << p->level);
+}
+
+/**
+  * Makes p READY at the front of its level, so that it resumes before any
+  * other task of the same level (used for preempted tasks).
+  */
+static void Ready_Front(PD *p)
+{
+	p->state = READY;
+#if PERIODIC_POLICY != PERIODIC_FIFO
+	if (p->priority == PERIODIC && p->level == PERIODIC) {
+		Periodic_Insert(p, TRUE);
+		ready_levels |= (1 << PERIODIC);
+		return;
+	}
+#endif
+	Queue_Push_Front(&ready_queue[p->level], p);
+	ready_levels |= (1 << p->level);
+}
+
+/**
+  * Makes p READY to run as soon as the caller enters the kernel, before any
+  * other task of its level. Must be followed by Enter_Kernel().
+  */
+static void Handoff(PD *p)
+{
+#ifdef DIRECT_HANDOFF
+	p->state = READY;
+	handoff = p;
+#else
+	Ready(p);
+#endif
+}
+
+/**
+  * The live task whose PID is id, or NULL if it has died (or never was):
+  * the slot in id must hold a task still of the generation in id.
+  */
+static PD *Pid_Lookup(PID id)
+{
+	PD *p;
+
+	if ((id & PID_SLOT_MASK) >= PID_SLOTS) {
+		return NULL;
+	}
+	p = pid_to_pd[id & PID_SLOT_MASK];
+	if (p == NULL || p->pid != id || p->state == DEAD) {
+		return NULL;
+	}
+	return p;
+}
+
+/**
+  * Puts p in the timer queue to wake up "ticks" TICKs from now.
+  */
+static void Timer_Arm(PD *p, TICK ticks)
+{
+	PD **q;
+	TICK d;
+
+	if (timer_head == NULL) {
+		timer_base = Ticks();
+	}
+	d = (TICK)(Ticks() - timer_base) + ticks;
+	for (q = &timer_head; *q != NULL && (*q)->delta <= d; q = &(*q)->timer_next) {
+		d -= (*q)->delta;
+	}
+	if (*q != NULL) {
+		(*q)->delta -= d;
+	}
+	p->delta = d;
+	p->timer_next = *q;
+	*q = p;
+	p->timer = TIMER_ARMED;
+}
+
+/**
+  * Takes p out of the timer queue, if it is in it, because what it was
+  * waiting for has happened in time, or never will.
+  */
+static void Timer_Cancel(PD *p)
+{
+	PD **q;
+
+	if (p->timer != TIMER_ARMED) {
+		return;
+	}
+	for (q = &timer_head; *q != p; q = &(*q)->timer_next) {
+	}
+	*q = p->timer_next;
+	if (*q != NULL) {
+		(*q)->delta += p->delta;
+	}
+	p->timer = TIMER_OFF;
+}
+
+/**
+  * Wakes up every task in the timer queue whose time has come. A task in a
+  * timed Msg_Send() leaves the queue of the task it was sending to, if that
+  * task is still there and still has it queued.
+  */
+static void Timer_Expire()
+{
+	TICK elapsed = Ticks() - timer_base;
+
+	while (timer_head != NULL && timer_head->delta <= elapsed) {
+		PD *p = timer_head;
+
+		elapsed -= p->delta;
+		timer_base += p->delta;
+		timer_head = p->timer_next;
+		/* a sleep is over when its time runs out, a timed wait has failed */
+		p->timer = (p->state == SLEEPING) ? TIMER_OFF : TIMER_EXPIRED;
+		if (p->state == SNDBLOCK) {
+			PD *r = Pid_Lookup(p->msg_pid);
+			PD *prev = NULL;
+			PD *cur = NULL;
+
+			if (r != NULL) {
+				for (cur = r->senders.head; cur != NULL && cur != p; cur = cur->next) {
+					prev = cur;
+				}
+			}
+			if (cur != NULL) {
+				Queue_Remove(&r->senders, prev, p);
+			}
+		}
+		Ready(p);
+		p->request = NONE;
+	}
+}
+
+#ifdef SOFT_TIMERS
+/**
+  * Arms t to expire "ticks" (at least 1) TICKs after wheel_tick.
+  */
+static void Wheel_Insert(SOFT_TIMER_CB *t, TICK ticks)
+{
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	t->slot = (wheel_tick + ticks) & TIMER_WHEEL_MASK;
+	t->rounds = (ticks - 1) / TIMER_WHEEL_SIZE;
+	t->prev = NULL;
+	t->next = timer_wheel[t->slot];
+	if (t->next != NULL) {
+		t->next->prev = t;
+	}
+	timer_wheel[t->slot] = t;
+	t->armed = TRUE;
+	++soft_timers_armed;
+}
+
+static void Wheel_Remove(SOFT_TIMER_CB *t)
+{
+	if (t->prev != NULL) {
+		t->prev->next = t->next;
+	} else {
+		timer_wheel[t->slot] = t->next;
+	}
+	if (t->next != NULL) {
+		t->next->prev = t->prev;
+	}
+	t->armed = FALSE;
+	--soft_timers_armed;
+}
+
+/**
+  * Turns the wheel up to the current TICK, one slot per TICK, and hands
+  * the timers that expire to the timer task. An auto-reload timer is armed
+  * again from the TICK it expired on, so that it does not drift.
+  */
+static void Soft_Timer_Expire()
+{
+	TICK now = Ticks();
+
+	while (wheel_tick != now) {
+		SOFT_TIMER_CB *t = timer_wheel[++wheel_tick & TIMER_WHEEL_MASK];
+
+		while (t != NULL) {
+			SOFT_TIMER_CB *next = t->next;
+
+			if (t->rounds != 0) {
+				--t->rounds;
+			} else {
+				/* re-armed at the head of the list, so not met again here */
+				Wheel_Remove(t);
+				if (t->mode == SOFT_TIMER_AUTO_RELOAD) {
+					Wheel_Insert(t, t->period);
+				}
+				soft_timers_due |= 1 << (t - soft_timers);
+			}
+			t = next;
+		}
+	}
+	if (soft_timers_due != 0 && timer_task.state == SUSPENDED) {
+		timer_task.request = NONE;
+		Ready(&timer_task);
+	}
+}
+#endif
+
+#if defined(CYCLIC_EXECUTIVE) || (defined(ADMISSION_CONTROL) && PERIODIC_POLICY == PERIODIC_FIFO)
+static TICK Gcd(TICK a, TICK b)
+{
+	while (b != 0) {
+		TICK t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+#endif
+
+#ifndef CYCLIC_EXECUTIVE
+/**
+  * Inserts a SUSPENDED periodic task into the release queue, keeping the
+  * queue sorted by next_release. Ties keep their insertion order.
+  */
+static void Schedule_Release(PD *p)
+{
+	PD *prev = NULL;
+	PD *cur = release_queue.head;
+
+	while (cur != NULL && (int16_t)(cur->next_release - p->next_release) <= 0) {
+		prev = cur;
+		cur = cur->next;
+	}
+	Queue_Insert(&release_queue, prev, p);
+}
+
+/**
+  * Moves every periodic task whose release time has come from the release
+  * queue to the PERIODIC ready queue.
+  */
+static void Release_Periodic()
+{
+	TICK now = Ticks();
+
+	while (release_queue.head != NULL
+			&& (int16_t)(now - release_queue.head->next_release) >= 0) {
+		PD *p = Queue_Pop(&release_queue);
+		p->release = p->next_release;
+		p->next_release += p->period;
+		p->skipped = FALSE;
+		p->request = NONE;
+		Ready(p);
+	}
+}
+#else
+/**
+  * Makes the release of p that falls in the current minor frame, unless it
+  * is one of the visits to skip.
+  */
+static void Cyclic_Release(PD *p)
+{
+	if (p->cycles_left != 0) {
+		--p->cycles_left;
+		return;
+	}
+	p->cycles_left = p->cycles - 1;
+	p->next_release = cyclic_tick + p->period;
+	/* a job that is still running misses this release */
+	if (p->state == SUSPENDED) {
+		p->release = cyclic_tick;
+		p->skipped = FALSE;
+		p->request = NONE;
+		Ready(p);
+	}
+}
+
+/**
+  * Steps through the table up to the current TICK, one lookup per TICK,
+  * releasing the tasks marked in each frame.
+  */
+static void Release_Periodic()
+{
+	TICK now = Ticks();
+
+	if (cyclic_major == 0) {
+		cyclic_tick = now;
+		return;
+	}
+	while (cyclic_tick != now) {
+		CYCLIC_MASK mask;
+		uint8_t x;
+
+		++cyclic_tick;
+		if (++cyclic_frame == cyclic_major) {
+			cyclic_frame = 0;
+		}
+		mask = cyclic_table[cyclic_frame];
+		for (x = 0; mask != 0; x++, mask >>= 1) {
+			if (mask & 1) {
+				Cyclic_Release(&periodic_tasks[x]);
+			}
+		}
+	}
+}
+
+/**
+  * Rebuilds the release table from the periodic tasks' next_release, with
+  * the current TICK as frame 0. The major frame is the lcm of the periods
+  * of at most CYCLIC_FRAMES TICKs; a longer period must be a multiple of it,
+  * and its task is marked in a single frame and released every
+  * period / major frame visits. The releases up to the current TICK must
+  * have been made already.
+  */
+static void Cyclic_Build()
+{
+	uint32_t major = 1;
+	uint8_t x;
+
+	for (x = 0; x < MAXPERIODICPROCESS; x++) {
+		PD *p = &periodic_tasks[x];
+		if (p->state != DEAD && p->priority == PERIODIC && p->period <= CYCLIC_FRAMES) {
+			major = major / Gcd(major, p->period) * p->period;
+			if (major > CYCLIC_FRAMES) {
+				abort_pid = p->pid;
+				OS_Abort(CYCLIC_TABLE_OVERFLOW);
+			}
+		}
+	}
+
+	memset(cyclic_table, 0, sizeof(cyclic_table));
+	cyclic_major = major;
+	cyclic_frame = 0;
+
+	for (x = 0; x < MAXPERIODICPROCESS; x++) {
+		PD *p = &periodic_tasks[x];
+		TICK unit;
+		TICK delta;
+		TICK f;
+
+		if (p->state == DEAD || p->priority != PERIODIC) {
+			continue;
+		}
+		unit = p->period <= CYCLIC_FRAMES ? p->period : major;
+		if (p->period % unit != 0) {
+			abort_pid = p->pid;
+			OS_Abort(CYCLIC_TABLE_OVERFLOW);
+		}
+		/* a release that is due now is made here, the table starts after it */
+		if (p->next_release == cyclic_tick && p->state == SUSPENDED) {
+			p->release = cyclic_tick;
+			p->request = NONE;
+			Ready(p);
+		}
+		while ((int16_t)(p->next_release - cyclic_tick) <= 0) {
+			p->next_release += p->period;
+		}
+		delta = p->next_release - cyclic_tick;
+		for (f = delta % unit; f < major; f += unit) {
+			cyclic_table[f] |= (CYCLIC_MASK)1 << x;
+		}
+		p->cycles = p->period / unit;
+		p->cycles_left = (delta - 1) / unit;  /* earlier visits of those frames */
+	}
+}
+#endif
+
+#ifdef ADMISSION_CONTROL
+/*===========
+  * Admission control
+  *===========
+  *
+  * Under PERIODIC_FIFO, a periodic task with wcet > 0 owns the wcet TICKs
+  * that start at each of its releases; no other periodic job may be released
+  * in them. A wcet of 0 marks a job that finishes well inside the TICK it is
+  * released in; any number of those may share a TICK, but not one owned by
+  * another task. Such a job takes no time as far as admission control can
+  * tell, so it is up to the application that a set of them fits.
+  * Under PERIODIC_EDF, a set is feasible iff its utilization is at most 1.
+  * Under PERIODIC_RM, every task's worst-case response time must be within
+  * its period.
+  */
+
+#if PERIODIC_POLICY == PERIODIC_FIFO
+/**
+  * TRUE if some job of a task released at ra + k*pa (owning ca TICKs) can
+  * overlap some job of one released at rb + k*pb (owning cb TICKs).
+  * The difference between any two releases is (rb - ra) plus a multiple of
+  * gcd(pa, pb), so only its residue d modulo that gcd matters: the jobs
+  * overlap iff d < ca, or d > g - cb.
+  */
+static uint8_t Release_Collision(TICK ra, TICK pa, TICK ca, TICK rb, TICK pb, TICK cb)
+{
+	TICK g;
+	int32_t d;
+
+	if (ca == 0 && cb == 0) {
+		return 0;
+	}
+	if (ca == 0) {
+		ca = 1;
+	}
+	if (cb == 0) {
+		cb = 1;
+	}
+	g = Gcd(pa, pb);
+	d = (int16_t)(rb - ra) % (int32_t)g;
+	if (d < 0) {
+		d += g;
+	}
+	return d < ca || d + cb > g;
+}
+#endif
+
+#if PERIODIC_POLICY == PERIODIC_RM
+/**
+  * Worst-case response time of a job of t, found by iterating
+  *   R = wcet + sum over the other tasks u with period(u) <= period(t)
+  *              of ceil(R / period(u)) * wcet(u)
+  * to its fixed point, or the first R beyond t's period. "n" is the task
+  * being admitted, which already counts as part of the set.
+  */
+static uint32_t Response_Time(PD *t, PD *n)
+{
+	uint32_t r = t->wcet;
+	uint32_t next;
+	int x;
+
+	while (r != 0) {
+		next = t->wcet;
+		for (x = 0; x < MAXPERIODICPROCESS; x++) {
+			PD *u = &periodic_tasks[x];
+			if (u != t && ((u->state != DEAD && u->priority == PERIODIC) || u == n) && u->period <= t->period) {
+				next += ((r + u->period - 1) / u->period) * u->wcet;
+			}
+		}
+		if (next == r || next > t->period) {
+			return next;
+		}
+		r = next;
+	}
+	return 0;  /* a wcet of 0 is taken to need no time */
+}
+#endif
+
+/**
+  * Checks the new periodic task n, whose period, wcet and next_release are
+  * set but which is still DEAD, against the periodic tasks admitted so far.
+  * Returns NO_ERROR if n may join them, or else why the set would be
+  * infeasible. Under PERIODIC_FIFO the utilization test is only a quick
+  * filter; the pairwise collision test is exact for the non-preemptive
+  * periodic level.
+  */
+static ERROR_TYPES Admit_Periodic(PD *n)
+{
+	uint32_t utilization = 0;
+	int x;
+
+	if (n->period == 0 || n->wcet >= n->period) {
+		return UTILIZATION_EXCEEDED;
+	}
+	for (x = 0; x < MAXPERIODICPROCESS; x++) {
+		PD *p = &periodic_tasks[x];
+		if ((p->state != DEAD && p->priority == PERIODIC) || p == n) {
+			utilization += ((uint32_t)p->wcet * UTILIZATION_ONE) / p->period;
+		}
+	}
+	if (utilization > UTILIZATION_ONE) {
+		return UTILIZATION_EXCEEDED;
+	}
+#if PERIODIC_POLICY == PERIODIC_FIFO
+	for (x = 0; x < MAXPERIODICPROCESS; x++) {
+		PD *p = &periodic_tasks[x];
+		if (p->state != DEAD && p->priority == PERIODIC
+				&& Release_Collision(p->next_release, p->period, p->wcet, n->next_release, n->period, n->wcet)) {
+			return RELEASE_COLLISION;
+		}
+	}
+#elif PERIODIC_POLICY == PERIODIC_RM
+	for (x = 0; x < MAXPERIODICPROCESS; x++) {
+		PD *p = &periodic_tasks[x];
+		if (((p->state != DEAD && p->priority == PERIODIC) || p == n) && Response_Time(p, n) > p->period) {
+			return UTILIZATION_EXCEEDED;
+		}
+	}
+#endif
+	return NO_ERROR;
+}
+#endif
+
+/**
+  * Gives p a stack of at least "size" bytes, reusing the one it already has
+  * if it is large enough.
+  */
+static void Stack_Alloc(PD *p, unsigned int size)
+{
+	if (size < STACK_MIN) {
+		size = STACK_MIN;
+	}
+	if (p->workSpace != NULL && p->stack_size >= size) {
+		return;
+	}
+	if (size > STACK_ARENA_SIZE - stack_arena_used) {
+		OS_Abort(STACK_ARENA_EXHAUSTED);
+	}
+	p->workSpace = &stack_arena[stack_arena_used];
+	p->stack_size = size;
+	stack_arena_used += size;
+}
+
+/**
+ * When creating a new task, it is important to initialize its stack just like
+ * it has called "Enter_Kernel()"; so that when we switch to it later, we
+ * can just restore its execution context on its stack.
+ * (See file "cswitch.S" for details.)
+ * Lays down such a frame, to start f, at the top of p's workSpace and returns
+ * the stack pointer below it.
+ */
+static unsigned char *Init_Frame(PD *p, voidfuncptr f)
+{
+    unsigned char *sp;
+
+    //Changed -2 to -1 to fix off by one error.
+    sp = (unsigned char *)&(p->workSpace[p->stack_size - 1]);
+
+#ifdef OS_HOST
+    sp = Port_Init_Stack(&(p->workSpace[p->stack_size]), f);
+#else
+    //Notice that we are placing the address (16-bit) of the functions
+    //onto the stack in reverse byte order (least significant first, followed
+    //by most significant).  This is because the "return" assembly instructions
+    //(rtn and rti) pop addresses off in BIG ENDIAN (most sig. first, least sig.
+    //second), even though the AT90 is LITTLE ENDIAN machine.
+
+    //Store terminate at the bottom of stack to protect against stack underrun.
+    *(unsigned char *)sp-- = ((unsigned int)Task_Terminate) & 0xff;
+    *(unsigned char *)sp-- = (((unsigned int)Task_Terminate) >> 8) & 0xff;
+    *(unsigned char *)sp-- = 0;
+
+    //Place return address of function at bottom of stack
+    *(unsigned char *)sp-- = ((unsigned int)f) & 0xff;
+    *(unsigned char *)sp-- = (((unsigned int)f) >> 8) & 0xff;
+    *(unsigned char *)sp-- = 0;
+
+    //The initial context is a short frame (see SAVECALLEE in cswitch.s):
+    //r2-r17, r28 and r29 as 0, topped by its marker
+    sp = sp - CALLEE_SAVED_REGS;
+    memset(sp + 1, 0, CALLEE_SAVED_REGS);
+    *(unsigned char *)sp-- = FRAME_SHORT;
+#endif
+    return sp;
+}
+
+void Kernel_Create_Task_At(PD *p, voidfuncptr f, unsigned int stack)
+{
+	uint8_t generation = (p->pid >> PID_SLOT_BITS) + 1;
+
+	/* the slot stays, the generation moves on; 0 never makes a PID */
+	if (generation == 0) {
+		generation = 1;
+	}
+	p->pid = ((uint16_t)generation << PID_SLOT_BITS) | (p->pid & PID_SLOT_MASK);
+
+    /*----BEGIN of NEW CODE----*/
+    //Initialize the workspace (i.e., stack) and PD here!
+#ifdef JOB_STACKS
+    if (p->job != NULL) {
+        /* another job may be under way on the shared stack: leave it alone,
+           Job_Enter() lays down the frame when a job starts */
+        p->own_workSpace = p->workSpace;
+        p->own_stack_size = p->stack_size;
+        p->workSpace = p->job->workSpace;
+        p->stack_size = JOB_STACK;
+    } else
+#endif
+    {
+        Stack_Alloc(p, stack);
+
+        //Fill the workspace with a known pattern so its high-water mark can be
+        //found later, and lay down the canary at its bottom.
+        memset(p->workSpace, STACK_FILL, p->stack_size);
+        memset(p->workSpace, STACK_CANARY, STACK_CANARY_SIZE);
+
+        p->sp = Init_Frame(p, f);  /* stack pointer into the "workSpace" */
+    }
+    p->code = f; /* function to be executed as a task */
+    p->level = p->priority;
+    p->timer = TIMER_OFF;
+    p->overrun = OVERRUN_DEFAULT;
+    p->violations = 0;
+    p->skipped = FALSE;
+    p->senders.head = NULL;
+    p->senders.tail = NULL;
+#ifdef MAILBOXES
+    p->mail_count = 0;
+    p->mail_dropped = 0;
+#endif
+#ifdef BUFFER_POOL
+    p->buf = NULL;
+#endif
+#ifdef SYNC_OBJECTS
+    p->held = NULL;
+    p->blocked_on = NULL;
+#endif
+#ifdef EXEC_STATS
+    memset(&p->stats, 0, sizeof(p->stats));
+    p->exec_total = 0;
+    p->job_us = 0;
+#endif
+
+    /*----END of NEW CODE----*/
+
+	
+    
+	
+	if(p->priority == PERIODIC) {
+		p->request = WAITING;
+		p->state = SUSPENDED;
+	} else if(p->priority != IDLE) {
+		p->request = NONE;
+		Ready(p);
+	} else {
+		p->request = NONE;
+		p->state = READY;
+	}
+}
+
+/**
+  *  Create a new task
+  */
+static PD *Kernel_Create_Task(voidfuncptr f, unsigned int priority, unsigned int stack)
+{
+    int x;
+    PD *queue;
+	int maxlength;
+
+    switch (priority)
+    {
+	case IDLE:
+		idle_task.priority = IDLE;
+		Kernel_Create_Task_At(&idle_task, f, stack);
+		return &idle_task;
+    case ROUND_ROBIN:
+        queue = round_robin_tasks;
+		maxlength = MAXRRPROCESS;
+        break;
+    case PERIODIC:
+        queue = periodic_tasks;
+		maxlength = MAXPERIODICPROCESS;
+        break;
+    case SYSTEM:
+        queue = system_tasks;
+		maxlength = MAXSYSTEMPROCESS;
+        break;
+    default:
+        queue = round_robin_tasks;
+		maxlength = MAXRRPROCESS;
+        break;
+    }
+
+    if (Tasks >= MAXTHREADS) {
+		OS_Abort(TOO_MANY_TASKS);
+	}
+
+    /* find a DEAD PD that we can use  */
+    for (x = 0; x < maxlength; x++)
+    {
+        if (queue[x].state == DEAD)
+            break;
+    }
+	
+	if(x == maxlength)
+		OS_Abort(QUEUE_SPACE_EXCEEDED);
+	
+	queue[x].priority = priority;
+
+    ++Tasks;
+    Kernel_Create_Task_At(&(queue[x]), f, stack);
+    return &(queue[x]);
+}
+
+#ifdef JOB_STACKS
+/**
+  * Where every job of a Task_Create_Job() task starts: the task's function
+  * runs the job, and its frame is thrown away once the job is done.
+  */
+static void Job_Run()
+{
+	Cp->code();
+	Task_Next();
+}
+
+/**
+  * Lets Cp, a Task_Create_Job() task, onto its shared stack. A new job gets
+  * a fresh frame at the top. But while a job of the same level is under way
+  * there, preempted, it is the stack resource policy with the stack as the
+  * resource: Cp goes back to the front of the queue, and that job runs in
+  * its place until it is done.
+  */
+static void Job_Enter()
+{
+	PD *owner = Cp->job->owner;
+
+	if (owner == Cp) {
+		return;
+	}
+	if (owner == NULL) {
+		Cp->job->owner = (PD *)Cp;
+		Cp->sp = Init_Frame((PD *)Cp, Job_Run);
+		return;
+	}
+	if (owner->state != READY) {
+		/* the job under way has blocked, which jobs must not do */
+		abort_pid = owner->pid;
+		OS_Abort(JOB_BLOCKED);
+	}
+	Ready_Front((PD *)Cp);
+	Queue_Unlink(&ready_queue[owner->level], &ready_levels, owner->level, owner);
+	Cp = owner;
+}
+#endif
+
+#ifdef TICKLESS_IDLE
+/**
+  * Number of TICKs from now until the kernel has timed work to do, capped at
+  * TICKLESS_MAX_TICKS. Only called after Release_Periodic(), so the head of
+  * the release queue is always in the future (and the cyclic executive's
+  * table is at the current TICK).
+  */
+static TICK Next_Timer_Event()
+{
+	TICK ticks = TICKLESS_MAX_TICKS;
+
+#ifdef CYCLIC_EXECUTIVE
+	if (cyclic_major != 0) {
+		TICK f = cyclic_frame;
+		TICK until;
+		for (until = 1; until < ticks; until++) {
+			if (++f == cyclic_major) {
+				f = 0;
+			}
+			if (cyclic_table[f] != 0) {
+				ticks = until;
+				break;
+			}
+		}
+	}
+#else
+	if (release_queue.head != NULL) {
+		TICK until = release_queue.head->next_release - Ticks();
+		if (until < ticks) {
+			ticks = until;
+		}
+	}
+#endif
+	if (timer_head != NULL) {
+		TICK until = timer_base + timer_head->delta - Ticks();
+		if (until < ticks) {
+			ticks = until;
+		}
+	}
+#ifdef SOFT_TIMERS
+	if (soft_timers_armed != 0) {
+		/* the next slot with a timer in it; at worst, a turn of the wheel */
+		TICK until;
+		for (until = 1; until < TIMER_WHEEL_SIZE && until < ticks; until++) {
+			if (timer_wheel[(wheel_tick + until) & TIMER_WHEEL_MASK] != NULL) {
+				break;
+			}
+		}
+		if (until < ticks) {
+			ticks = until;
+		}
+	}
+#endif
+	return ticks;
+}
+
+/**
+  * Called when the idle task is about to run: stretches the current TIMER4
+  * period so that the next compare match is the next kernel timed event.
+  * TCNT4 keeps counting from where it is, so TICK boundaries stay aligned.
+  */
+static void Tickless_Enter()
+{
+	TICK ticks = Next_Timer_Event();
+
+	/* a compare match is already pending and accounted for as one TICK */
+	if (ticks <= 1 || (TIFR4 & (1 << OCF4A))) {
+		return;
+	}
+	tick_step = ticks;
+	OCR4A = ticks * (TIMER_TICK_TOP + 1) - 1;
+	tickless_active = TRUE;
+}
+
+/**
+  * Called on every kernel entry: returns TIMER4 to a one-TICK period and
+  * credits tick_count with the whole TICKs slept, if the idle period ended
+  * early (i.e., not by the TIMER4 compare match).
+  */
+static void Tickless_Exit()
+{
+	if (!tickless_active) {
+		return;
+	}
+	tickless_active = FALSE;
+
+	if (!(TIFR4 & (1 << OCF4A))) {
+		uint16_t count = TCNT4;
+		/* if the compare match was serviced, TCNT4 restarted and is < one TICK */
+		tick_count += count / (TIMER_TICK_TOP + 1);
+		TCNT4 = count % (TIMER_TICK_TOP + 1);
+		tick_step = 1;
+	}
+	/* otherwise the pending compare match will add tick_step itself */
+	OCR4A = TIMER_TICK_TOP;
+}
+#endif
+
+/**
+  * TRUE if the job of p, a PERIODIC task about to run, has broken its timing:
+  * under PERIODIC_FIFO, it is still running wcet TICKs after its release,
+  * otherwise, it has not finished by its next release.
+  */
+static uint8_t Late(PD *p)
+{
+#ifdef LIGHTWEIGHT_TASKS
+	if (p == &lwt_runner) {
+		/* LWT jobs are not timed */
+		return FALSE;
+	}
+#endif
+#if PERIODIC_POLICY == PERIODIC_FIFO
+	if (p->wcet == 0) {
+		/* a sub-TICK job is not timed by the TICK, only held to its period */
+		return (TICK)(Ticks() - p->release) >= p->period;
+	}
+	return (TICK)(Ticks() - p->release) > p->wcet;
+#else
+	/* jobs may be delayed by each other, but not past their next release */
+	return (TICK)(Ticks() - p->release) >= p->period;
+#endif
+}
+
+#ifdef SYNC_OBJECTS
+static PRIORITY_LEVELS Inherited_Level(PD *p);
+#endif
+#ifdef EVENT_GROUPS
+static void Event_Deliver();
+#endif
+
+/**
+  * Deals with the late job of p as p's overrun policy says: aborts, or
+  * changes p so that it can go back into the ready queues. Either way, the
+  * job has not been lost.
+  */
+static void Overrun(PD *p)
+{
+	++p->violations;
+#ifdef JOB_STACKS
+	if (p->job != NULL && p->overrun == OVERRUN_DEMOTE) {
+		/* a job cannot leave the level whose stack it is on */
+		p->overrun = OVERRUN_ABORT;
+	}
+#endif
+	switch (p->overrun)
+	{
+	case OVERRUN_SKIP:
+		/* the late job takes the place of the next one, whose release is skipped
+		   along with any other it has already run past; its own release stays
+		   one that has come, and it is not checked again */
+		p->next_release += p->period;
+		while ((int16_t)(Ticks() - (p->release + p->period)) >= 0) {
+			p->release += p->period;
+		}
+		if ((int16_t)(p->release + p->period - p->next_release) > 0) {
+			p->next_release = p->release + p->period;
+		}
+		p->skipped = TRUE;
+		break;
+	case OVERRUN_SHIFT:
+		/* the late job counts as released now, and later releases move with it */
+		p->release = Ticks();
+		p->next_release = p->release + p->period;
+		break;
+	case OVERRUN_DEMOTE:
+		/* the task finishes this job, and carries on, as a RR task */
+		p->priority = ROUND_ROBIN;
+#ifdef SYNC_OBJECTS
+		p->level = Inherited_Level(p);
+#else
+		p->level = ROUND_ROBIN;
+#endif
+		break;
+	default:
+		abort_pid = p->pid;
+#if PERIODIC_POLICY == PERIODIC_FIFO
+		OS_Abort(WCET_EXCEEDED);
+#else
+		OS_Abort(DEADLINE_MISSED);
+#endif
+	}
+}
+
+#ifdef DIRECT_HANDOFF
+/**
+  * TRUE if p, a task handed the CPU, may run ahead of the tasks ready at
+  * "level": it is of a higher level, or of the same level and not behind a
+  * job that comes first in the periodic policy's order.
+  */
+static uint8_t Handoff_Ahead(PD *p, uint8_t level)
+{
+	if (p->level != level) {
+		return p->level > level;
+	}
+#if PERIODIC_POLICY != PERIODIC_FIFO
+	if (p->priority == PERIODIC && p->level == PERIODIC) {
+		PD *head = ready_queue[PERIODIC].head;
+
+		return head->priority == PERIODIC && !Periodic_Before(head, p);
+	}
+#endif
+	return TRUE;
+}
+#endif
+
 /**
   * This internal kernel function is a part of the "scheduler". It chooses the 
   * next task to run, i.e., Cp.
+  *
+  * The caller must already have put the previous Cp back into a ready queue
+  * (or the release queue) if it is still runnable. Picking the next task is
+  * constant-time: the highest non-empty level comes from ready_levels, and
+  * its queue head is the next task. If nothing is ready, the idle task runs.
+  */
+static void Dispatch()
+{
+	uint8_t level;
+
+#ifdef TICKLESS_IDLE
+	Tickless_Exit();
+#endif
+	Release_Periodic();
+	Timer_Expire();
+#ifdef SOFT_TIMERS
+	Soft_Timer_Expire();
+#endif
+#ifdef EVENT_GROUPS
+	Event_Deliver();
+#endif
+
+	for (;;) {
+		level = highest_level[ready_levels];
+#ifdef DIRECT_HANDOFF
+		if (handoff != NULL) {
+			PD *p = handoff;
+
+			handoff = NULL;
+			if (!Handoff_Ahead(p, level)) {
+				/* somebody more urgent came along; the partner is next in line */
+				Ready_Front(p);
+				continue;
+			}
+			Cp = p;
+		} else
+#endif
+		{
+			if (level == IDLE) {
+				Cp = &(idle_task);
+#ifdef TICKLESS_IDLE
+				Tickless_Enter();
+#endif
+				return;
+			}
+
+			Cp = Queue_Pop(&ready_queue[level]);
+			if (ready_queue[level].head == NULL) {
+				ready_levels &= ~(1 << level);
+			}
+		}
+		if (Cp->priority != PERIODIC || Cp->skipped || !Late((PD *)Cp)) {
+			break;
+		}
+		/* a late job that has been let off may have to make way now */
+		Overrun((PD *)Cp);
+		Ready_Front((PD *)Cp);
+	}
+#ifdef JOB_STACKS
+	if (Cp->job != NULL) {
+		Job_Enter();
+	}
+#endif
+	CurrentSp = Cp->sp;
+	Cp->state = RUNNING;
+}
+
+/**
+  * Puts the task that just left the CPU back where it belongs, according to
+  * the request it made.
+  */
+static void Requeue_Current()
+{
+	PD *p = (PD *)Cp;
+
+	if (p == &idle_task) {
+		p->state = READY;
+		return;
+	}
+
+	switch (p->request)
+	{
+	case WAITING:
+		/* a periodic task which finished its job waits for its next release;
+		   any other WAITING task is blocked and is made READY by its partner */
+#ifdef JOB_STACKS
+		if (p->job != NULL && p->state == SUSPENDED) {
+			/* and a job's frame goes with it */
+			p->job->owner = NULL;
+		}
+#endif
+#ifndef CYCLIC_EXECUTIVE
+		if (p->priority == PERIODIC && p->state == SUSPENDED) {
+			Schedule_Release(p);
+		}
+#endif
+		break;
+	case NEXT:
+		Ready(p);
+		break;
+	case NONE:
+		/* preempted: a RR task has used up its quantum and goes to the back of
+		   its level, everybody else resumes before its peers */
+		if (p->priority == ROUND_ROBIN) {
+			Ready(p);
+		} else {
+			Ready_Front(p);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+#ifdef KERNEL_TRACE
+/**
+  * Appends a record to the trace ring buffer. When the buffer is full, the
+  * oldest record is overwritten and counted in trace_dropped. Wakes the
+  * drain task up, unless the record is about the idle task: the drain task
+  * hands the CPU to it every time it has emptied the buffer.
+  */
+static void Trace(uint16_t pid, uint8_t event)
+{
+	TRACE_RECORD *r = &trace_buffer[trace_head];
+	PD *d;
+
+	r->tick = (uint16_t)tick_count;
+	r->tcnt = TCNT4;
+	r->pid = pid;
+	r->event = event;
+	trace_head = (trace_head + 1) & (TRACE_SIZE - 1);
+	if (trace_head == trace_tail) {
+		trace_tail = (trace_tail + 1) & (TRACE_SIZE - 1);
+		++trace_dropped;
+	}
+	if (pid != idle_task.pid) {
+		d = Pid_Lookup(trace_drain_pid);
+		if (d != NULL && d->state == SUSPENDED) {
+			d->request = NONE;
+			Ready(d);
+		}
+	}
+}
+#endif
+
+#ifdef STACK_CHECK
+/**
+  * Aborts, showing the task's PID, if the task has run its stack pointer
+  * into the canary or has overwritten the canary. Cheap enough to run on
+  * every context switch.
+  */
+static void Check_Stack(PD *p)
+{
+	if (p->sp < &(p->workSpace[STACK_CANARY_SIZE - 1])
+			|| p->workSpace[0] != STACK_CANARY
+			|| p->workSpace[STACK_CANARY_SIZE - 1] != STACK_CANARY) {
+		abort_pid = p->pid;
+		OS_Abort(STACK_OVERFLOW);
+	}
+}
+#endif
+
+#ifdef BUFFER_POOL
+/**
+  * Index in buf_pool of b. Aborts unless b is a pool buffer that the
+  * current task owns.
+  */
+static uint8_t Buf_Index(void *b)
+{
+	unsigned char *c = (unsigned char *)b;
+	unsigned int off;
+
+	if (c < &buf_pool[0][0] || c >= &buf_pool[0][0] + sizeof(buf_pool)) {
+		abort_pid = Cp->pid;
+		OS_Abort(BUFFER_NOT_OWNED);
+	}
+	off = c - &buf_pool[0][0];
+	if (off % BUF_SIZE != 0 || buf_owner[off / BUF_SIZE] != Cp) {
+		abort_pid = Cp->pid;
+		OS_Abort(BUFFER_NOT_OWNED);
+	}
+	return off / BUF_SIZE;
+}
+
+/**
+  * Hands the buffer lent with from's message, if there is one, over to to.
+  */
+static void Buf_Lend(PD *from, PD *to)
+{
+	to->buf = from->buf;
+	if (from->buf != NULL) {
+		buf_owner[((unsigned char *)from->buf - &buf_pool[0][0]) / BUF_SIZE] = to;
+	}
+}
+
+/**
+  * Returns every buffer that p still owns to the pool.
+  */
+static void Buf_Release(PD *p)
+{
+	uint8_t i;
+
+	for (i = 0; i < BUF_COUNT; i++) {
+		if (buf_owner[i] == p) {
+			buf_owner[i] = NULL;
+		}
+	}
+}
+#endif
+
+#ifdef SYNC_OBJECTS
+static void Wait_Push(WAIT_QUEUE *w, PD *p)
+{
+	Queue_Push_Back(&w->queue[p->level], p);
+	w->levels |= (1 << p->level);
+}
+
+/**
+  * Removes and returns the first of the highest level tasks waiting on w,
+  * or NULL if there is none.
+  */
+static PD *Wait_Pop(WAIT_QUEUE *w)
+{
+	uint8_t level = highest_level[w->levels];
+	PD *p;
+
+	if (w->levels == 0) {
+		return NULL;
+	}
+	p = Queue_Pop(&w->queue[level]);
+	if (w->queue[level].head == NULL) {
+		w->levels &= ~(1 << level);
+	}
+	return p;
+}
+
+/**
+  * Moves p to "level", requeueing it if it is READY or waiting on a mutex.
+  */
+static void Set_Level(PD *p, PRIORITY_LEVELS level)
+{
+	if (p->state == READY) {
+		Queue_Unlink(&ready_queue[p->level], &ready_levels, p->level, p);
+		p->level = level;
+		Ready(p);
+	} else if (p->state == MTXBLOCK) {
+		WAIT_QUEUE *w = &p->blocked_on->waiters;
+
+		Queue_Unlink(&w->queue[p->level], &w->levels, p->level, p);
+		p->level = level;
+		Wait_Push(w, p);
+	} else {
+		p->level = level;
+	}
+}
+
+/**
+  * The level p is entitled to: its own priority, or the level of the
+  * highest task waiting on any mutex it holds.
+  */
+static PRIORITY_LEVELS Inherited_Level(PD *p)
+{
+	PRIORITY_LEVELS level = p->priority;
+	MUTEX_CB *m;
+
+	for (m = p->held; m != NULL; m = m->next_held) {
+		if (highest_level[m->waiters.levels] > level) {
+			level = highest_level[m->waiters.levels];
+		}
+	}
+	return level;
+}
+
+/**
+  * Raises the owner of m to at least "level", and so on down the chain of
+  * mutexes that the owners are themselves blocked on.
+  */
+static void Inherit(MUTEX_CB *m, PRIORITY_LEVELS level)
+{
+	while (m != NULL && m->owner->level < level) {
+		PD *o = m->owner;
+
+		Set_Level(o, level);
+		m = (o->state == MTXBLOCK) ? o->blocked_on : NULL;
+	}
+}
+
+/**
+  * Gives m, which its owner has just let go of, to the highest task waiting
+  * on it, or unlocks it if there is none. Returns the new owner, or NULL.
+  */
+static PD *Mutex_Hand_Over(MUTEX_CB *m)
+{
+	PD *p = Wait_Pop(&m->waiters);
+
+	m->owner = p;
+	if (p != NULL) {
+		p->blocked_on = NULL;
+		m->next_held = p->held;
+		p->held = m;
+		p->level = Inherited_Level(p);
+		Ready(p);
+		p->request = NONE;
+	}
+	return p;
+}
+
+/**
+  * Hands over every mutex that p still holds.
+  */
+static void Mutex_Release_All(PD *p)
+{
+	while (p->held != NULL) {
+		MUTEX_CB *m = p->held;
+
+		p->held = m->next_held;
+		Mutex_Hand_Over(m);
+	}
+}
+#endif
+
+#ifdef EXEC_STATS
+/**
+  * TRUE if p, which has just entered the kernel, gave up the CPU of its own
+  * accord: by Task_Next(), by blocking or by terminating. A Periodic job
+  * only ends at Task_Next() or when its task terminates, though.
+  */
+static uint8_t Stats_Job_Done(PD *p)
+{
+	if (p == &idle_task) {
+		return FALSE;
+	}
+#ifdef LIGHTWEIGHT_TASKS
+	if (p == &lwt_runner) {
+		return p->request != NONE;
+	}
+#endif
+	if (p->priority == PERIODIC) {
+		return p->state == SUSPENDED || p->request == TERMINATE;
+	}
+	return p->request != NONE;
+}
+
+/**
+  * Adds p's job that has just ended to its statistics.
+  */
+static void Stats_Job_End(PD *p)
+{
+	if (p->stats.jobs == 0 || p->job_us < p->stats.exec_min) {
+		p->stats.exec_min = p->job_us;
+	}
+	if (p->job_us > p->stats.exec_max) {
+		p->stats.exec_max = p->job_us;
+	}
+	++p->stats.jobs;
+	p->exec_total += p->job_us;
+	if (p->priority == PERIODIC) {
+		if (p->wcet != 0 && p->job_us > p->wcet * (MSECPERTICK * 1000UL)) {
+			++p->stats.overruns;
+		}
+		if ((TICK)(Ticks() - p->release) >= p->period) {
+			++p->stats.deadline_misses;
+		}
+	}
+	p->job_us = 0;
+}
+#endif
+
+/**
+  * This internal kernel function is the "main" driving loop of this full-served
+  * model architecture. Basically, on OS_Start(), the kernel repeatedly
+  * requests the next user task's next system call and then invokes the
+  * corresponding kernel function on its behalf.
+  *
+  * This is the main loop of our kernel, called by OS_Start().
+  */
+static void Next_Kernel_Request()
+{
+#ifdef EXEC_STATS
+    PD *out;
+    uint8_t job_done;
+#endif
+
+    Dispatch(); /* select a new task to run */
+
+    while (1)
+    {
+		if(Cp->request != WAITING)
+			Cp->request = NONE; /* clear its request */
+
+        /* activate this newly selected task */
+        CurrentSp = Cp->sp;
+#ifdef KERNEL_TRACE
+		if (Cp->pid != trace_drain_pid) {
+			Trace(Cp->pid, TRACE_IN);
+		}
+#endif
+#ifdef EXEC_STATS
+		Cp->switched_in = Now_us();
+#endif
+        Exit_Kernel(); /* or CSwitch() */
+
+		// tick_count++;
+        /* if this task makes a system call, it will return to here! */
+
+        /* save the Cp's stack pointer */
+        Cp->sp = (unsigned char *)CurrentSp;
+#ifdef EXEC_STATS
+		Cp->job_us += Now_us() - Cp->switched_in;
+		out = (PD *)Cp;
+		job_done = Stats_Job_Done(out);
+#endif
+#ifdef KERNEL_TRACE
+		if (Cp->pid != trace_drain_pid) {
+			Trace(Cp->pid, TRACE_OUT | (kernel_timer_entry ? TRACE_TIMER : Cp->request));
+		}
+#endif
+		kernel_timer_entry = 0;
+#ifdef STACK_CHECK
+		Check_Stack((PD *)Cp);
+#endif
+
+        switch (Cp->request)
+        {
+        case CREATE:
+            Kernel_Create_Task(Cp->code, Cp->priority, Cp->stack_size);
+            break;
+		case WAITING:
+        case NEXT:
+        case NONE:
+            /* NONE could be caused by a timer interrupt */
+            Requeue_Current();
+            Dispatch();
+            break;
+        case TERMINATE:
+            /* deallocate all resources used by this task */
+            Cp->state = DEAD;
+#ifdef BUFFER_POOL
+            Buf_Release((PD *)Cp);
+#endif
+#ifdef JOB_STACKS
+            if (Cp->job != NULL) {
+                if (Cp->job->owner == Cp) {
+                    Cp->job->owner = NULL;
+                }
+                /* the next task in this PD gets the PD's own stack back */
+                Cp->workSpace = Cp->own_workSpace;
+                Cp->stack_size = Cp->own_stack_size;
+                Cp->job = NULL;
+            }
+#endif
+#ifdef SYNC_OBJECTS
+            Mutex_Release_All((PD *)Cp);
+#endif
+            /* nobody is going to receive what its senders are waiting to send */
+            while (Cp->senders.head != NULL) {
+                PD *s = Queue_Pop((PD_QUEUE *)&Cp->senders);
+
+                Timer_Cancel(s);
+                s->timer = TIMER_ABANDONED;
+                s->request = NONE;
+                Ready(s);
+            }
+            Dispatch();
+            break;
+        default:
+            /* Houston! we have a problem here! */
+            break;
+        }
+#ifdef EXEC_STATS
+		if (job_done) {
+			Stats_Job_End(out);
+		} else if (out != Cp && out->state == READY) {
+			++out->stats.preemptions;
+		}
+#endif
+    }
+}
+
+/**
+  * The idle task sleeps until the next interrupt. IDLE sleep mode keeps
+  * TIMER4 and the USARTs running, so any of them can wake it up. If the
+  * interrupt made a task READY (Msg_ASend_ISR()), or set event flags that a
+  * task may be waiting for (Event_Set_ISR()), the idle task gives way to it
+  * at once: with TICKLESS_IDLE the next TICK may be a long way off.
+  */
+void idle()
+{
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	for(;;) {
+		Disable_Interrupt();
+#ifdef EVENT_GROUPS
+		if (ready_levels != 0 || events_posted != 0) {
+#else
+		if (ready_levels != 0) {
+#endif
+			Task_Next();
+			continue;
+		}
+		/* sei takes effect after the sleep, so no wake-up is lost in between */
+		sleep_enable();
+		Enable_Interrupt();
+		sleep_cpu();
+		sleep_disable();
+	}
+}
+
+/*================
+  * RTOS  API  and Stubs
+  *================
+  */
+
+/**
+  * Whole TICKs since OS_Init() and, in *count, the TIMER4 count into the
+  * next one. Safe with interrupts enabled or not: it rereads until no TICK
+  * has been counted meanwhile, and it counts a compare match that has
+  * already restarted TCNT4 but has not been serviced yet.
+  */
+static uint32_t Time_Now(uint16_t *count)
+{
+	uint32_t ticks;
+	uint16_t c;
+	uint8_t step;
+	uint8_t pending;
+
+	do {
+		ticks = tick_count;
+		step = tick_step;
+		c = TCNT4;
+		pending = TIFR4 & (1 << OCF4A);
+	} while (ticks != tick_count);
+
+	if (pending && c < (OCR4A >> 1)) {
+		ticks += step;
+	}
+	*count = c;
+	return ticks;
+}
+
+uint32_t Now(void) {
+	uint16_t count;
+	uint32_t ticks = Time_Now(&count);
+
+	return ticks * MSECPERTICK + ((uint32_t)count * TIMER_US_PER_COUNT) / 1000;
+}
+
+BOOL Task_Stats(PID id, TASK_STATS *s)
+{
+#ifdef EXEC_STATS
+	PD *p;
+
+	Disable_Interrupt();
+	p = Pid_Lookup(id);
+	if (p == NULL) {
+		Enable_Interrupt();
+		return FALSE;
+	}
+	*s = p->stats;
+	if (p->stats.jobs != 0) {
+		s->exec_avg = p->exec_total / p->stats.jobs;
+	}
+	Enable_Interrupt();
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+uint32_t Now_us(void) {
+	uint16_t count;
+	uint32_t ticks = Time_Now(&count);
+
+	return ticks * (MSECPERTICK * 1000UL) + (uint32_t)count * TIMER_US_PER_COUNT;
+}
+
+void OS_Abort(unsigned int error) {
+	Disable_Interrupt();
+#ifdef OS_HOST
+	Port_Abort(error, abort_pid);
+#endif
+	int i;
+	int j;
+	
+	DDRB = 0xff;
+	PORTB = 0;
+
+	for(j = 0; j < 3; ++j) {
+		for(i = 0; i < error; ++i) {
+			PORTB = 0xff;
+			_delay_ms(100);
+			PORTB = 0;
+			_delay_ms(100);
+		}
+		_delay_ms(500);
+	}
+	if(abort_pid >= 0) {
+		PORTB = abort_pid; // show the offending task's PID in binary
+	}
+	_delay_ms(3000);
+	asm("jmp 0x00"); // jump to the first instruction, resetting system
+}
+
+/**
+  * This function initializes the RTOS and must be called before any other
+  * system calls.
+  */
+void OS_Init()
+{
+    int x;
+	int n;
+	
+	DDRL = 0xff;
+    Tasks = 0;
+    KernelActive = 0;
+	tick_count = 0;
+	tick_step = 1;
+	ready_levels = 0;
+	memset(ready_queue, 0, sizeof(ready_queue));
+#ifdef CYCLIC_EXECUTIVE
+	cyclic_major = 0;
+#else
+	memset(&release_queue, 0, sizeof(release_queue));
+#endif
+    //Reminder: Clear the memory for the task on creation.
+	stack_arena_used = 0;
+    for (x = 0; x < MAXRRPROCESS; x++)
+    {
+        memset(&(round_robin_tasks[x]), 0, sizeof(PD));
+        round_robin_tasks[x].state = DEAD;
+    }
+	for (x = 0; x < MAXSYSTEMPROCESS; x++) {
+		memset(&(system_tasks[x]), 0, sizeof(PD));
+		system_tasks[x].state = DEAD;
+	}
+	for(x = 0; x < MAXPERIODICPROCESS; x++) {
+		memset(&(periodic_tasks[x]), 0, sizeof(PD));
+		periodic_tasks[x].state = DEAD;
+	}
+#ifdef LIGHTWEIGHT_TASKS
+	memset(lwts, 0, sizeof(lwts));
+	lwt_queue = NULL;
+	memset(&lwt_runner, 0, sizeof(PD));
+	lwt_runner.state = DEAD;
+#endif
+#ifdef SOFT_TIMERS
+	memset(soft_timers, 0, sizeof(soft_timers));
+	soft_timer_count = 0;
+	soft_timers_armed = 0;
+	memset(timer_wheel, 0, sizeof(timer_wheel));
+	wheel_tick = 0;
+	soft_timers_due = 0;
+	memset(&timer_task, 0, sizeof(PD));
+	timer_task.state = DEAD;
+#endif
+
+	/* hand out the PID slots, generation 0; the first task in each is 1 */
+	n = 0;
+	for (x = 0; x < MAXSYSTEMPROCESS; x++) {
+		pid_to_pd[n++] = &system_tasks[x];
+	}
+	for (x = 0; x < MAXRRPROCESS; x++) {
+		pid_to_pd[n++] = &round_robin_tasks[x];
+	}
+	for (x = 0; x < MAXPERIODICPROCESS; x++) {
+		pid_to_pd[n++] = &periodic_tasks[x];
+	}
+	pid_to_pd[n++] = &idle_task;
+#ifdef LIGHTWEIGHT_TASKS
+	pid_to_pd[n++] = &lwt_runner;
+#endif
+#ifdef SOFT_TIMERS
+	pid_to_pd[n++] = &timer_task;
+#endif
+	for (x = 0; x < n; x++) {
+		pid_to_pd[x]->pid = x;
+	}
+}
+
+/**
+  * This function starts the RTOS after creating a few tasks.
+  */
+void OS_Start()
+{
+    if ((!KernelActive) && (Tasks > 0))
+    {
+        Disable_Interrupt();
+        /* we may have to initialize the interrupt vector for Enter_Kernel() here. */
+
+        /* here we go...  */
+        KernelActive = 1;
+        Next_Kernel_Request();
+        /* NEVER RETURNS!!! */
+    }
+}
+
+void setupTimer()
+{
+    TCCR4A = 0;
+    TCCR4B = 0;
+
+    //set to CTC (mode 4)
+    TCCR4B |= (1 << WGM32);
+
+    //set prescaler to 256
+    TCCR4B |= (1 << CS42);
+
+    //set TOP value (0.01 seconds)
+    OCR4A = TIMER_TICK_TOP;
+
+    //Enable interrupt A for timer 3
+    TIMSK4 |= (1 << OCIE4A);
+
+    //Set timer to 0
+    TCNT4 = 0;
+
+    sei();
+}
+
+/**
+  * For this example, we only support cooperatively multitasking, i.e.,
+  * each task gives up its share of the processor voluntarily by calling
+  * Task_Next().
+  */
+PID Task_Create_RR(voidfuncptr f, int arg)
+{
+	return Task_Create_RR_Stack(f, arg, WORKSPACE);
+}
+
+PID Task_Create_RR_Stack(voidfuncptr f, int arg, unsigned int stack)
+{
+	int x;
+	PID pid = 0;
+	for (x = 0; x < MAXRRPROCESS; x++)
+	{
+		if (round_robin_tasks[x].state == DEAD)
+		break;
+	}
+    if (KernelActive)
+    {
+        if (x == MAXRRPROCESS) {
+            return 0;
+        }
+        Disable_Interrupt();
+        round_robin_tasks[x].request = NONE;
+        round_robin_tasks[x].priority = ROUND_ROBIN;
+        round_robin_tasks[x].code = f;
+		round_robin_tasks[x].arg = arg;
+		Kernel_Create_Task_At(&round_robin_tasks[x], f, stack);
+		pid = round_robin_tasks[x].pid;
+        Enter_Kernel();
+    }
+    else
+    {
+        /* call the RTOS function directly */
+        PD *p = Kernel_Create_Task(f, ROUND_ROBIN, stack);
+        p->arg = arg;
+        pid = p->pid;
+    }
+	return pid;
+}
+
+#ifdef JOB_STACKS
+/**
+  * The shared stack of preemption level "level", made on first use.
+  * Called with interrupts disabled.
+  */
+static JOB_STACK_CB *Job_Stack_Get(TICK level)
+{
+	JOB_STACK_CB *s;
+	uint8_t i;
+
+	for (i = 0; i < job_stack_count; i++) {
+		if (job_stacks[i].level == level) {
+			return &job_stacks[i];
+		}
+	}
+	if (job_stack_count == MAXJOBSTACKS) {
+		OS_Abort(QUEUE_SPACE_EXCEEDED);
+	}
+	if (JOB_STACK > STACK_ARENA_SIZE - stack_arena_used) {
+		OS_Abort(STACK_ARENA_EXHAUSTED);
+	}
+	s = &job_stacks[job_stack_count++];
+	s->level = level;
+	s->workSpace = &stack_arena[stack_arena_used];
+	s->owner = NULL;
+	stack_arena_used += JOB_STACK;
+	memset(s->workSpace, STACK_FILL, JOB_STACK);
+	memset(s->workSpace, STACK_CANARY, STACK_CANARY_SIZE);
+	return s;
+}
+#endif
+
+/**
+  * Sets up a periodic task in a free periodic PD and schedules its first
+  * release. Returns 0 if there is no free PD or admission control refuses
+  * the task. With "job", it runs on the shared stack of its preemption level
+  * (see Task_Create_Job()), and "stack" must be 0.
+  * Called with interrupts disabled, while the kernel is running.
+  */
+static PID Create_Periodic(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset, unsigned int stack, uint8_t job)
+{
+	PD *p;
+	int x;
+
+#ifdef ADMISSION_CONTROL
+	admission_error = NO_ERROR;
+#endif
+	for (x = 0; x < MAXPERIODICPROCESS; x++)
+	{
+		if (periodic_tasks[x].state == DEAD)
+		break;
+	}
+	if (x == MAXPERIODICPROCESS) {
+		return 0;
+	}
+	p = &periodic_tasks[x];
+#ifdef CYCLIC_EXECUTIVE
+	/* the table is rebuilt from the current TICK on */
+	Release_Periodic();
+#endif
+	p->request = NONE;
+	p->priority = PERIODIC;
+	p->period = period;
+	p->wcet = wcet;
+	p->offset = offset;
+	p->code = f;
+	p->release = Ticks();
+	p->next_release = Ticks() + offset;
+	p->arg = arg;
+#ifdef ADMISSION_CONTROL
+	/* refused before anything is taken for it: the PD is still DEAD */
+	admission_error = Admit_Periodic(p);
+	if (admission_error != NO_ERROR) {
+		return 0;
+	}
+#endif
+#ifdef JOB_STACKS
+	if (!job) {
+		p->job = NULL;
+	} else {
+#if PERIODIC_POLICY == PERIODIC_FIFO || defined(CYCLIC_EXECUTIVE)
+		/* jobs never preempt each other: one stack does for all of them */
+		p->job = Job_Stack_Get(0);
+#else
+		/* a job only preempts jobs of a longer period (EDF, RM) */
+		p->job = Job_Stack_Get(period);
+#endif
+	}
+#endif
+	Kernel_Create_Task_At(p, f, stack);
+#ifdef CYCLIC_EXECUTIVE
+	Cyclic_Build();
+#else
+	Schedule_Release(p);
+#endif
+	return p->pid;
+}
+
+unsigned int Task_Admission_Error()
+{
+#ifdef ADMISSION_CONTROL
+	return admission_error;
+#else
+	return NO_ERROR;
+#endif
+}
+
+PID Task_Create_Period(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset)
+{
+	return Task_Create_Period_Stack(f, arg, period, wcet, offset, WORKSPACE);
+}
+
+PID Task_Create_Period_Stack(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset, unsigned int stack)
+{
+	PID pid = 0;
+	// for periodic tasks, to make implementation less messy, we will assume that periodic tasks may only be created after the RTOS has started
+    if (KernelActive)
+    {
+        Disable_Interrupt();
+		pid = Create_Periodic(f, arg, period, wcet, offset, stack, FALSE);
+        Enter_Kernel();
+    }
+	return pid;
+}
+
+#ifdef JOB_STACKS
+PID Task_Create_Job(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset)
+{
+	PID pid = 0;
+	if (KernelActive)
+	{
+		Disable_Interrupt();
+		pid = Create_Periodic(f, arg, period, wcet, offset, 0, TRUE);
+		Enter_Kernel();
+	}
+	return pid;
+}
+#endif
+
+#ifdef LIGHTWEIGHT_TASKS
+/**
+  * Puts t in lwt_queue, behind the LWTs released at the same TICK.
+  * Called with interrupts disabled.
+  */
+static void Lwt_Enqueue(LWT *t)
+{
+	LWT **q = &lwt_queue;
+
+	while (*q != NULL && (int16_t)((*q)->release - t->release) <= 0) {
+		q = &(*q)->next;
+	}
+	t->next = *q;
+	*q = t;
+}
+
+/**
+  * Gives the runner the release and period of t, the LWT it runs or waits
+  * for, so that it takes its place among the PERIODIC jobs by policy.
+  * Called with interrupts disabled.
+  */
+static void Lwt_Place(LWT *t)
+{
+	lwt_runner.release = t->release;
+	lwt_runner.period = t->period;
+}
+
+/**
+  * The runner task: runs each LWT whose release has come, one job at a
+  * time, and sleeps in between.
+  */
+static void Lwt_Run()
+{
+	LWT *t;
+
+	for (;;) {
+		Disable_Interrupt();
+		t = lwt_queue;
+		if (t == NULL || (int16_t)(Ticks() - t->release) < 0) {
+			/* Lwt_Create_Period() wakes us up if there is nothing to wait for */
+			if (t != NULL) {
+				Lwt_Place(t);
+				Timer_Arm((PD *)Cp, t->release - Ticks());
+			}
+			Cp->state = SLEEPING;
+			Cp->request = WAITING;
+			Enter_Kernel();
+			continue;
+		}
+		lwt_queue = t->next;
+		Lwt_Place(t);
+		Enable_Interrupt();
+
+		if (t->code(t) == LWT_ENDED) {
+			Disable_Interrupt();
+			t->code = NULL;
+		} else {
+			Disable_Interrupt();
+			t->release += t->period;
+			Lwt_Enqueue(t);
+		}
+		Enable_Interrupt();
+	}
+}
+
+LWT *Lwt_Create_Period(lwtfuncptr f, int arg, TICK period, TICK offset)
+{
+	LWT *t;
+	uint8_t x;
+
+	Disable_Interrupt();
+	for (x = 0; x < MAXLWT && lwts[x].code != NULL; x++) {
+	}
+	if (x == MAXLWT) {
+		Enable_Interrupt();
+		return NULL;
+	}
+	t = &lwts[x];
+	t->lc = 0;
+	t->arg = arg;
+	t->code = f;
+	t->period = period;
+	t->release = Ticks() + offset;
+	Lwt_Enqueue(t);
+
+	if (lwt_runner.state == DEAD) {
+		/* a periodic task, but one that sleeps rather than waiting in the
+		   release queue, and is left out of admission control and the
+		   periodic timing checks */
+		lwt_runner.priority = PERIODIC;
+		Kernel_Create_Task_At(&lwt_runner, Lwt_Run, LWT_STACK);
+		lwt_runner.state = SLEEPING;
+	}
+	if (lwt_runner.state == SLEEPING) {
+		/* let it look at the queue again */
+		Lwt_Place(lwt_queue);
+		Timer_Cancel(&lwt_runner);
+		lwt_runner.request = NONE;
+		Ready(&lwt_runner);
+		if (KernelActive && lwt_runner.level > Cp->level) {
+			Enter_Kernel();
+			return t;
+		}
+	}
+	Enable_Interrupt();
+	return t;
+}
+#endif
+
+#ifdef SOFT_TIMERS
+static SOFT_TIMER_CB *Soft_Timer_Get(SOFT_TIMER id)
+{
+	if (id == 0 || id > soft_timer_count) {
+		abort_pid = Cp->pid;
+		OS_Abort(SYNC_NOT_FOUND);
+	}
+	return &soft_timers[id - 1];
+}
+
+/**
+  * The timer task: runs the callback of every timer that has expired,
+  * lowest handle first, and waits for Soft_Timer_Expire() in between.
+  */
+static void Soft_Timer_Run()
+{
+	SOFT_TIMER_CB *t;
+	uint8_t x;
+
+	for (;;) {
+		Disable_Interrupt();
+		if (soft_timers_due == 0) {
+			Cp->state = SUSPENDED;
+			Cp->request = WAITING;
+			Enter_Kernel();
+			continue;
+		}
+		for (x = 0; !(soft_timers_due & (1 << x)); x++) {
+		}
+		soft_timers_due &= ~(1 << x);
+		t = &soft_timers[x];
+		Enable_Interrupt();
+
+		t->code(t->arg);
+	}
+}
+
+SOFT_TIMER Soft_Timer_Create(timerfuncptr f, int arg, TICK period, uint8_t mode)
+{
+	SOFT_TIMER id = 0;
+
+	Disable_Interrupt();
+	if (soft_timer_count < MAXSOFTTIMER) {
+		SOFT_TIMER_CB *t = &soft_timers[soft_timer_count];
+
+		t->code = f;
+		t->arg = arg;
+		t->period = period;
+		t->mode = mode;
+		id = ++soft_timer_count;
+		if (timer_task.state == DEAD) {
+			/* READY, and suspends itself once it finds nothing to do */
+			timer_task.priority = SYSTEM;
+			Kernel_Create_Task_At(&timer_task, Soft_Timer_Run, SOFT_TIMER_STACK);
+		}
+	}
+	Enable_Interrupt();
+	return id;
+}
+
+void Soft_Timer_Start(SOFT_TIMER id)
+{
+	SOFT_TIMER_CB *t;
+
+	Disable_Interrupt();
+	t = Soft_Timer_Get(id);
+	if (t->armed) {
+		Wheel_Remove(t);
+	}
+	/* the wheel may not have caught up with the current TICK yet */
+	Wheel_Insert(t, t->period + (TICK)(Ticks() - wheel_tick));
+	Enable_Interrupt();
+}
+
+void Soft_Timer_Stop(SOFT_TIMER id)
+{
+	SOFT_TIMER_CB *t;
+
+	Disable_Interrupt();
+	t = Soft_Timer_Get(id);
+	if (t->armed) {
+		Wheel_Remove(t);
+	}
+	soft_timers_due &= ~(1 << (t - soft_timers));
+	Enable_Interrupt();
+}
+
+BOOL Soft_Timer_Active(SOFT_TIMER id)
+{
+	SOFT_TIMER_CB *t;
+	BOOL active;
+
+	Disable_Interrupt();
+	t = Soft_Timer_Get(id);
+	active = t->armed || (soft_timers_due & (1 << (t - soft_timers))) != 0;
+	Enable_Interrupt();
+	return active;
+}
+#endif
+
+PID Task_Create_System(voidfuncptr f, int arg)
+{
+	return Task_Create_System_Stack(f, arg, WORKSPACE);
+}
+
+PID Task_Create_System_Stack(voidfuncptr f, int arg, unsigned int stack)
+{
+	int x;
+	PID pid = 0;
+	for (x = 0; x < MAXSYSTEMPROCESS; x++)
+	{
+		if (system_tasks[x].state == DEAD)
+		break;
+	}
+    if (KernelActive)
+    {
+        if (x == MAXSYSTEMPROCESS) {
+            return 0;
+        }
+        Disable_Interrupt();
+        system_tasks[x].request = NONE;
+        system_tasks[x].priority = SYSTEM;
+        system_tasks[x].code = f;
+		system_tasks[x].arg = arg;
+		Kernel_Create_Task_At(&system_tasks[x], f, stack);
+		pid = system_tasks[x].pid;
+        Enter_Kernel();
+    }
+    else
+    {
+        /* call the RTOS function directly */
+        PD *p = Kernel_Create_Task(f, SYSTEM, stack);
+        p->arg = arg;
+        pid = p->pid;
+    }
+	return pid;
+}
+
+void Task_Create_Idle()
+{
+	Kernel_Create_Task(&idle, IDLE, IDLE_STACK);
+}
+
+
+/**
+  * Returns the number of bytes of its workspace that a task has used so far,
+  * found by looking for the deepest byte which no longer holds STACK_FILL.
   */
-static void Dispatch()
+static unsigned int Stack_High_Water(PD *p)
 {
-    /* find the next READY task
-       * Note: if there is no READY task, then this will loop forever!.
-       */
-	check_states();
-    int i;
+	unsigned int x;
 
-    for (i = 0; i < MAXPROCESS; ++i)
-    {
-        if (system_tasks[NextP_Sys].state == READY)
-        {
-            Cp = &(system_tasks[NextP_Sys]);
-            CurrentSp = Cp->sp;
-            Cp->state = RUNNING;
-            return;
-        }
-        NextP_Sys = (NextP_Sys + 1) % MAXPROCESS;
-    }
+	for (x = STACK_CANARY_SIZE; x < p->stack_size; x++) {
+		if (p->workSpace[x] != STACK_FILL)
+			break;
+	}
+	return p->stack_size - x;
+}
 
-    for (i = 0; i < MAXPERIODICPROCESS; ++i)
-    {
-        if (periodic_tasks[NextP_Per].state == READY)
-        {
-            Cp = &(periodic_tasks[NextP_Per]);
-			Cp->time_until_run -= Now() - Cp->last_check_time;
-			Cp->last_check_time = Now();
-			if(Cp->run_length > Cp->wcet) {
-				OS_Abort(WCET_EXCEEDED);
-			}
-            Cp->run_length += Now() - Cp->last_check_time;
-			CurrentSp = Cp->sp;
-			Cp->state = RUNNING;
-			Cp->request = NONE;
-            return;
-        } else if(periodic_tasks[NextP_Per].state == SUSPENDED) {
-			Cp = &(periodic_tasks[NextP_Per]);
-			Cp->time_until_run -= Now() - Cp->last_check_time;
-			Cp->last_check_time = Now();
-			if(Cp->time_until_run <= 0) {
-				Cp->run_length = 1;
-				Cp->time_until_run = Cp->period;
-				Cp->state = RUNNING;
-				Cp->request = NONE;
-				return;
-			}
+unsigned int Task_Stack_Used(PID id)
+{
+	PD *p = Pid_Lookup(id);
+
+	if (p == NULL) {
+		return 0;
+	}
+	return Stack_High_Water(p);
+}
+
+static void Stack_Dump_Table(PD *table, int count)
+{
+	int x;
+
+	for (x = 0; x < count; x++) {
+		if (table[x].state == DEAD)
+			continue;
+		uart0_puts_P("pid ");
+		uart0_putuint(table[x].pid);
+		uart0_puts_P(" level ");
+		uart0_putuint(table[x].priority);
+		uart0_puts_P(" stack ");
+		uart0_putuint(Stack_High_Water(&table[x]));
+		uart0_putc('/');
+		uart0_putuint(table[x].stack_size);
+		uart0_puts_P("\r\n");
+	}
+}
+
+/**
+  * Writes the stack high-water mark of every live task to UART0, which the
+  * caller must have initialized.
+  */
+void OS_Stack_Dump()
+{
+	Stack_Dump_Table(system_tasks, MAXSYSTEMPROCESS);
+	Stack_Dump_Table(periodic_tasks, MAXPERIODICPROCESS);
+	Stack_Dump_Table(round_robin_tasks, MAXRRPROCESS);
+	Stack_Dump_Table(&idle_task, 1);
+}
+
+#ifdef KERNEL_TRACE
+/**
+  * A task body which drains the trace buffer to UART0, one line per record:
+  *   <tick> <tcnt> <pid> I
+  *   <tick> <tcnt> <pid> O <reason>
+  * where reason is N(ext), T(erminate), W(aiting), P(reempted by TIMER4) or
+  * - (none, e.g. after Msg_Rply()). A "D <count>" line reports records lost
+  * to overflow. Meant to run as a low-priority RR task; it is SUSPENDED
+  * whenever the buffer is empty, so the idle task can still sleep, until
+  * Trace() wakes it up. UART0 must already be initialized. Its own switches
+  * are not recorded, or every wake-up would fill the buffer it has just
+  * emptied.
+  */
+void OS_Trace_Drain()
+{
+	static const char reasons[] = "-?NTW";
+	TRACE_RECORD r;
+	uint16_t dropped;
+
+	trace_drain_pid = Task_Pid();
+	for(;;) {
+		Disable_Interrupt();
+		if (trace_tail == trace_head) {
+			Cp->state = SUSPENDED;
+			Cp->request = WAITING;
+			Enter_Kernel();
+			continue;
 		}
-        NextP_Per = (NextP_Per + 1) % MAXPERIODICPROCESS;
-    }
+		r = trace_buffer[trace_tail];
+		trace_tail = (trace_tail + 1) & (TRACE_SIZE - 1);
+		dropped = trace_dropped;
+		trace_dropped = 0;
+		Enable_Interrupt();
+
+		if (dropped) {
+			uart0_puts_P("D ");
+			uart0_putuint(dropped);
+			uart0_puts_P("\r\n");
+		}
+		uart0_putuint(r.tick);
+		uart0_putc(' ');
+		uart0_putuint(r.tcnt);
+		uart0_putc(' ');
+		uart0_putuint(r.pid);
+		if (r.event & TRACE_OUT) {
+			uart0_puts_P(" O ");
+			r.event &= ~TRACE_OUT;
+			uart0_putc(r.event == TRACE_TIMER ? 'P' : r.event < sizeof(reasons) - 1 ? reasons[r.event] : '?');
+		} else {
+			uart0_puts_P(" I");
+		}
+		uart0_puts_P("\r\n");
+	}
+}
+#endif
 
-    for (i = 0; i < MAXPROCESS; ++i)
+/**
+  * The calling task gives up its share of the processor voluntarily.
+  */
+void Task_Next()
+{
+    if (KernelActive)
     {
-        if (round_robin_tasks[NextP_RR].state == READY)
-        {
-            Cp = &(round_robin_tasks[NextP_RR]);
-            CurrentSp = Cp->sp;
-            Cp->state = RUNNING;
-            NextP_RR = (NextP_RR + 1) % MAXPROCESS;
-            return;
-        }
-        NextP_RR = (NextP_RR + 1) % MAXPROCESS;
+        Disable_Interrupt();
+        Cp->request = NEXT;
+		if(Cp->priority == PERIODIC) {
+			Cp->state = SUSPENDED;
+			Cp->request = WAITING;
+		}
+        Enter_Kernel();
     }
-	
-	Cp = &(idle_task);
+}
+
+void Task_Sleep(TICK t)
+{
+	if (KernelActive)
+	{
+		Disable_Interrupt();
+		Cp->state = SLEEPING;
+		Cp->request = WAITING;
+		Timer_Arm((PD *)Cp, t);
+		Enter_Kernel();
+	}
+}
+
+int Task_GetArg(void)
+{
+	return Cp->arg;
+}
+
+PID Task_Pid(void)
+{
+	return Cp->pid;
+}
+
+void Task_Overrun_Policy(PID id, OVERRUN_POLICY policy)
+{
+	PD *p;
+
+	Disable_Interrupt();
+	p = Pid_Lookup(id);
+	if (p == NULL){
+		OS_Abort(PID_NOT_FOUND);
+	}
+	p->overrun = policy;
+	Enable_Interrupt();
+}
+
+unsigned int Task_Violations(PID id)
+{
+	PD *p = Pid_Lookup(id);
 
-    //while (round_robin_tasks[NextP_RR].state != READY)
-    //{
-    //NextP_RR = (NextP_RR + 1) % MAXPROCESS;
-    //}
-    //
-    //Cp = &(round_robin_tasks[NextP_RR]);
-    //CurrentSp = Cp->sp;
-    //Cp->state = RUNNING;
-    //
-    //NextP_RR = (NextP_RR + 1) % MAXPROCESS;
+	if (p != NULL) {
+		return p->violations;
+	}
+	return 0;
 }
 
+static int Match_Send(PD *r, MTYPE t){
+	if (r->state == RCVBLOCK){
+		if ((t & r->mask) != 0){
+			return 1;
+		}
+	}
+	return 0;
+};
+
 /**
-  * This internal kernel function is the "main" driving loop of this full-served
-  * model architecture. Basically, on OS_Start(), the kernel repeatedly
-  * requests the next user task's next system call and then invokes the
-  * corresponding kernel function on its behalf.
-  *
-  * This is the main loop of our kernel, called by OS_Start().
+  * Sends *v, and the buffer b if it is not NULL, to id and blocks until id
+  * replies. The reply is left in *v. If "timed", gives up and returns FALSE
+  * when id has not received the message within "timeout" TICKs.
+  * Called with interrupts disabled.
   */
-static void Next_Kernel_Request()
+static BOOL Send(PID id, MTYPE t, unsigned int *v, void *b, BOOL timed, TICK timeout)
 {
-    Dispatch(); /* select a new task to run */
+	PD *r = Pid_Lookup(id);
 
-    while (1)
-    {
-		if(Cp->request != WAITING)
-			Cp->request = NONE; /* clear its request */
+	if (r == NULL){
+		OS_Abort(PID_NOT_FOUND);
+	}
+#ifdef BUFFER_POOL
+	Cp->buf = b;
+#endif
+	if (Match_Send(r, t))
+	{
+		r->msg = *v;
+		r->msg_pid = Cp->pid;
+#ifdef BUFFER_POOL
+		Buf_Lend((PD *)Cp, r);
+#endif
+		Timer_Cancel(r);
+		Handoff(r);
+		r->request = NONE;
+		Cp->state = RPYBLOCK;
+		Cp->request = WAITING;
+	}
+	else if (timed && timeout == 0)
+	{
+		Enable_Interrupt();
+		return FALSE;
+	}
+	else
+	{
+		/* wait in the receiver's queue; Msg_Recv() picks us up from there */
+		Cp->msg_pid = id;
+		Cp->mask = (MASK)t;
+		Cp->msg = *v;
+		Cp->state = SNDBLOCK;
+		Cp->request = WAITING;
+		Queue_Push_Back(&r->senders, (PD *)Cp);
+		if (timed) {
+			Timer_Arm((PD *)Cp, timeout);
+		}
+	}
+	Enter_Kernel();
+	if (Cp->timer == TIMER_EXPIRED || Cp->timer == TIMER_ABANDONED) {
+		Cp->timer = TIMER_OFF;
+		return FALSE;
+	}
+	*v = Cp->msg;
+	return TRUE;
+}
 
-        /* activate this newly selected task */
-        CurrentSp = Cp->sp;
-        Exit_Kernel(); /* or CSwitch() */
+void Msg_Send(PID id, MTYPE t, unsigned int *v)
+{
+	Disable_Interrupt();
+	Send(id, t, v, NULL, FALSE, 0);
+}
 
-		// tick_count++;
-        /* if this task makes a system call, it will return to here! */
+BOOL Msg_Send_Timeout(PID id, MTYPE t, unsigned int *v, TICK timeout)
+{
+	Disable_Interrupt();
+	return Send(id, t, v, NULL, TRUE, timeout);
+}
 
-        /* save the Cp's stack pointer */
-        Cp->sp = (unsigned char *)CurrentSp;
+#ifdef BUFFER_POOL
+void *Buf_Alloc(void)
+{
+	uint8_t i;
 
-        switch (Cp->request)
-        {
-        case CREATE:
-            Kernel_Create_Task(Cp->code, Cp->priority, Cp->pid);
-            break;
-		case WAITING:
-			Dispatch();
+	Disable_Interrupt();
+	for (i = 0; i < BUF_COUNT; i++) {
+		if (buf_owner[i] == NULL) {
+			buf_owner[i] = (PD *)Cp;
+			Enable_Interrupt();
+			return buf_pool[i];
+		}
+	}
+	Enable_Interrupt();
+	return NULL;
+}
+
+void Buf_Free(void *b)
+{
+	Disable_Interrupt();
+	buf_owner[Buf_Index(b)] = NULL;
+	Enable_Interrupt();
+}
+
+void Msg_Send_Buf(PID id, MTYPE t, void *b, unsigned int *len)
+{
+	Disable_Interrupt();
+	Buf_Index(b);
+	Send(id, t, len, b, FALSE, 0);
+}
+#endif
+
+/**
+  * Wakes id up with the reply r, handing back the buffer it lent, if any.
+  * Returns id, still to be made READY, or NULL if id was not waiting for a
+  * reply. Called with interrupts disabled.
+  */
+static PD *Rply(PID id, unsigned int r)
+{
+	PD *s = Pid_Lookup(id);
+
+	if (s == NULL || s->state != RPYBLOCK) {
+		return NULL;
+	}
+	s->msg = r;
+#ifdef BUFFER_POOL
+	if (s->buf != NULL) {
+		/* the buffer goes back to the sender with the reply */
+		buf_owner[Buf_Index(s->buf)] = s;
+		if (Cp->buf == s->buf) {
+			Cp->buf = NULL;
+		}
+		s->buf = NULL;
+	}
+#endif
+	s->request = NONE;
+	return s;
+}
+
+/**
+  * Makes w, which the caller has just woken up, READY, and leaves the
+  * critical section. The caller only gives way if w is of a higher level.
+  */
+static void Wake(PD *w)
+{
+	if (w != NULL && w->level > Cp->level) {
+		Handoff(w);
+		Enter_Kernel();
+		return;
+	}
+	if (w != NULL) {
+		Ready(w);
+	}
+	Enable_Interrupt();
+}
+
+/**
+  * Takes, without blocking, the oldest message in the mailbox whose type
+  * matches m, or else the oldest such blocked sender; otherwise blocks until
+  * Msg_Send() or Msg_ASend() hands over a message, or, if "timed", for at
+  * most "timeout" TICKs. Returns FALSE if the time ran out.
+  * w, if not NULL, is a task the caller has just woken up: it is handed the
+  * CPU if the caller blocks, and made READY otherwise (see Wake()).
+  * Called with interrupts disabled.
+  */
+static BOOL Recv(MASK m, unsigned int *v, PID *from, BOOL timed, TICK timeout, PD *w)
+{
+	PD *prev = NULL;
+	PD *sender;
+
+#ifdef MAILBOXES
+	{
+		PD *self = (PD *)Cp;
+		uint8_t i;
+
+		for (i = 0; i < self->mail_count; i++) {
+			if ((self->mailbox[i].type & m) != 0) {
+				*v = self->mailbox[i].msg;
+#ifdef BUFFER_POOL
+				self->buf = NULL;
+#endif
+				--self->mail_count;
+				for (; i < self->mail_count; i++) {
+					self->mailbox[i] = self->mailbox[i + 1];
+				}
+				Wake(w);
+				*from = 0;
+				return TRUE;
+			}
+		}
+	}
+#endif
+	for (sender = Cp->senders.head; sender != NULL; sender = sender->next) {
+		if ((sender->mask & m) != 0) {
 			break;
-        case NEXT:
-        case NONE:
-            /* NONE could be caused by a timer interrupt */
-            Cp->state = READY;
-            Dispatch();
-            break;
-        case TERMINATE:
-            /* deallocate all resources used by this task */
-            Cp->state = DEAD;
-            Dispatch();
-            break;
-        default:
-            /* Houston! we have a problem here! */
-            break;
-        }
-    }
+		}
+		prev = sender;
+	}
+	if (sender != NULL) {
+		Queue_Remove((PD_QUEUE *)&Cp->senders, prev, sender);
+		Timer_Cancel(sender);
+		sender->state = RPYBLOCK;
+		Cp->msg = sender->msg;
+		Cp->msg_pid = sender->pid;
+#ifdef BUFFER_POOL
+		Buf_Lend(sender, (PD *)Cp);
+#endif
+		Wake(w);
+	} else if (timed && timeout == 0) {
+		Wake(w);
+		return FALSE;
+	} else {
+		Cp->mask = m;
+		Cp->state = RCVBLOCK;
+		Cp->request = WAITING;
+		if (timed) {
+			Timer_Arm((PD *)Cp, timeout);
+		}
+		if (w != NULL) {
+			Handoff(w);
+		}
+		Enter_Kernel();
+		if (Cp->timer == TIMER_EXPIRED) {
+			Cp->timer = TIMER_OFF;
+			return FALSE;
+		}
+	}
+
+	*v = Cp->msg;
+	*from = Cp->msg_pid;
+	return TRUE;
+}
+
+PID Msg_Recv(MASK m, unsigned int *v)
+{
+	PID from;
+
+	Disable_Interrupt();
+	Recv(m, v, &from, FALSE, 0, NULL);
+	return from;
+}
+
+BOOL Msg_Recv_Timeout(MASK m, unsigned int *v, PID *from, TICK timeout)
+{
+	Disable_Interrupt();
+	return Recv(m, v, from, TRUE, timeout, NULL);
+}
+
+#ifdef BUFFER_POOL
+PID Msg_Recv_Buf(MASK m, void **b, unsigned int *len)
+{
+	PID from = Msg_Recv(m, len);
+
+	*b = Cp->buf;
+	return from;
+}
+#endif
+
+void Msg_Rply(PID id, unsigned int r)
+{
+	Disable_Interrupt();
+	Wake(Rply(id, r));
+}
+
+PID Msg_Rply_Recv(PID id, unsigned int r, MASK m, unsigned int *v)
+{
+	PID from;
+
+	Disable_Interrupt();
+	Recv(m, v, &from, FALSE, 0, Rply(id, r));
+	return from;
+}
+
+/**
+  * Hands an asynchronous message to r if r is waiting for its type, or else
+  * leaves it in r's mailbox. Called with interrupts disabled.
+  */
+static void ASend(PD *r, MTYPE t, unsigned int v)
+{
+	if (r->state == RCVBLOCK && (t & r->mask) != 0)
+	{
+		r->msg = v;
+		r->msg_pid = 0;
+		Timer_Cancel(r);
+#ifdef BUFFER_POOL
+		r->buf = NULL;
+#endif
+		Ready(r);
+		r->request = NONE;
+	}
+#ifdef MAILBOXES
+	else if (r->mail_count < MAILBOX_DEPTH)
+	{
+		r->mailbox[r->mail_count].type = t;
+		r->mailbox[r->mail_count].msg = v;
+		++r->mail_count;
+	}
+	else
+	{
+		++r->mail_dropped;
+	}
+#endif
 }
 
-void idle()
+void Msg_ASend(PID id, MTYPE t, unsigned int v)
 {
-	for(;;);
-}
-
-/*================
-  * RTOS  API  and Stubs
-  *================
-  */
+	PD *r;
 
-TICK Now() {
-	return (TICK)tick_count;
-}
-
-void OS_Abort(unsigned int error) {
 	Disable_Interrupt();
-	int i;
-	int j;
-	
-	DDRB = 0xff;
-	PORTB = 0;
-
-	for(j = 0; j < 3; ++j) {
-		for(i = 0; i < error; ++i) {
-			PORTB = 0xff;
-			_delay_ms(100);
-			PORTB = 0;
-			_delay_ms(100);
-		}
-		_delay_ms(500);
+	r = Pid_Lookup(id);
+	if (r == NULL){
+		/* nobody left to tell */
+		Enable_Interrupt();
+		return;
 	}
-	_delay_ms(3000);
-	asm("jmp 0x00"); // jump to the first instruction, resetting system
+	ASend(r, t, v);
+	Enter_Kernel();
 }
 
 /**
-  * This function initializes the RTOS and must be called before any other
-  * system calls.
+  * Msg_ASend() for interrupt handlers: it never enters the kernel, so a task
+  * it wakes up runs at the next kernel entry: at once if the CPU was idle,
+  * or else on the next TICK.
   */
-void OS_Init()
+void Msg_ASend_ISR(PID id, MTYPE t, unsigned int v)
 {
-    int x;
-	
-	DDRL = 0xff;
-    pid_index = 0;
-    Tasks = 0;
-    KernelActive = 0;
-    NextP_RR = 0;
-    NextP_Per = 0;
-    NextP_Sys = 0;
-	tick_count = 0;
-    //Reminder: Clear the memory for the task on creation.
-    for (x = 0; x < MAXPROCESS; x++)
-    {
-        memset(&(round_robin_tasks[x]), 0, sizeof(PD));
-        round_robin_tasks[x].state = DEAD;
-		memset(&(periodic_tasks[x]), 0, sizeof(PD));
-		periodic_tasks[x].state = DEAD;
-    }
-	for(x = 0; x < MAXPERIODICPROCESS; x++) {
-		memset(&(system_tasks[x]), 0, sizeof(PD));
-		system_tasks[x].state = DEAD;
+	PD *r = Pid_Lookup(id);
+
+	if (r != NULL) {
+		ASend(r, t, v);
 	}
 }
 
-/**
-  * This function starts the RTOS after creating a few tasks.
-  */
-void OS_Start()
+unsigned int Msg_Overflows(PID id)
 {
-    if ((!KernelActive) && (Tasks > 0))
-    {
-        Disable_Interrupt();
-        /* we may have to initialize the interrupt vector for Enter_Kernel() here. */
+#ifdef MAILBOXES
+	PD *r = Pid_Lookup(id);
 
-        /* here we go...  */
-        KernelActive = 1;
-        Next_Kernel_Request();
-        /* NEVER RETURNS!!! */
-    }
+	if (r != NULL) {
+		return r->mail_dropped;
+	}
+#endif
+	return 0;
 }
 
-void setupTimer()
+#ifdef SYNC_OBJECTS
+static MUTEX_CB *Mutex_Get(MUTEX id)
 {
-    TCCR4A = 0;
-    TCCR4B = 0;
-
-    //set to CTC (mode 4)
-    TCCR4B |= (1 << WGM32);
+	if (id == 0 || id > mutex_count) {
+		abort_pid = Cp->pid;
+		OS_Abort(SYNC_NOT_FOUND);
+	}
+	return &mutexes[id - 1];
+}
 
-    //set prescaler to 256
-    TCCR4B |= (1 << CS42);
+static SEMAPHORE_CB *Sem_Get(SEMAPHORE id)
+{
+	if (id == 0 || id > semaphore_count) {
+		abort_pid = Cp->pid;
+		OS_Abort(SYNC_NOT_FOUND);
+	}
+	return &semaphores[id - 1];
+}
 
-    //set TOP value (0.01 seconds)
-    OCR4A = 625;
+MUTEX Mutex_Init(void)
+{
+	MUTEX id = 0;
 
-    //Enable interrupt A for timer 3
-    TIMSK4 |= (1 << OCIE4A);
+	Disable_Interrupt();
+	if (mutex_count < MAXMUTEX) {
+		id = ++mutex_count;
+	}
+	Enable_Interrupt();
+	return id;
+}
 
-    //Set timer to 0
-    TCNT4 = 0;
+void Mutex_Lock(MUTEX id)
+{
+	MUTEX_CB *m;
 
-    sei();
+	Disable_Interrupt();
+	m = Mutex_Get(id);
+	if (m->owner == NULL) {
+		m->owner = (PD *)Cp;
+		m->next_held = Cp->held;
+		Cp->held = m;
+		Enable_Interrupt();
+		return;
+	}
+	if (m->owner == Cp) {
+		abort_pid = Cp->pid;
+		OS_Abort(MUTEX_RELOCKED);
+	}
+	/* wait, lending our level to the owner until it unlocks */
+	Cp->state = MTXBLOCK;
+	Cp->request = WAITING;
+	Cp->blocked_on = m;
+	Wait_Push(&m->waiters, (PD *)Cp);
+	Inherit(m, Cp->level);
+	Enter_Kernel();
 }
 
 /**
-  * For this example, we only support cooperatively multitasking, i.e.,
-  * each task gives up its share of the processor voluntarily by calling
-  * Task_Next().
+  * Only enters the kernel if the caller has to give way, either to the
+  * task it handed the mutex to or because it lost an inherited level.
   */
-PID Task_Create_RR(voidfuncptr f, int arg)
+void Mutex_Unlock(MUTEX id)
 {
-	int x;
-	for (x = 0; x < MAXPROCESS; x++)
+	MUTEX_CB *m;
+	PD *p = (PD *)Cp;
+	PD *q;
+	PRIORITY_LEVELS level;
+
+	Disable_Interrupt();
+	m = Mutex_Get(id);
+	if (m->owner != p) {
+		abort_pid = p->pid;
+		OS_Abort(MUTEX_NOT_OWNED);
+	}
 	{
-		if (round_robin_tasks[x].state == DEAD)
-		break;
+		MUTEX_CB **h;
+
+		for (h = &p->held; *h != m; h = &(*h)->next_held) {
+		}
+		*h = m->next_held;
 	}
-    if (KernelActive)
-    {
-        Disable_Interrupt();
-        round_robin_tasks[x].request = NONE;
-        round_robin_tasks[x].priority = ROUND_ROBIN;
-        round_robin_tasks[x].code = f;
-        round_robin_tasks[x].pid = pid_index++;
-		round_robin_tasks[x].arg = arg;
-		Kernel_Create_Task_At(&round_robin_tasks[x], f, pid_index);
-        Enter_Kernel();
-    }
-    else
-    {
-        /* call the RTOS function directly */
-        Kernel_Create_Task(f, ROUND_ROBIN, pid_index++);
-    }
-	return (PID)pid_index;
+	q = Mutex_Hand_Over(m);
+	level = Inherited_Level(p);
+	if (level == p->level && (q == NULL || q->level <= level)) {
+		Enable_Interrupt();
+		return;
+	}
+	p->level = level;
+	Enter_Kernel();
 }
 
-PID Task_Create_Period(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset)
+SEMAPHORE Sem_Init(unsigned int count)
 {
-	int x;
-	for (x = 0; x < MAXPERIODICPROCESS; x++)
-	{
-		if (periodic_tasks[x].state == DEAD)
-		break;
+	SEMAPHORE id = 0;
+
+	Disable_Interrupt();
+	if (semaphore_count < MAXSEMAPHORE) {
+		semaphores[semaphore_count].count = count;
+		id = ++semaphore_count;
 	}
-	// for periodic tasks, to make implementation less messy, we will assume that periodic tasks may only be created after the RTOS has started
-    if (KernelActive)
-    {
-        Disable_Interrupt();
-        periodic_tasks[x].request = NONE;
-        periodic_tasks[x].priority = PERIODIC;
-		periodic_tasks[x].period = period;
-		periodic_tasks[x].wcet = wcet;
-		periodic_tasks[x].offset = offset;
-        periodic_tasks[x].code = f;
-        periodic_tasks[x].pid = pid_index++;
-		periodic_tasks[x].run_length = 0;
-		periodic_tasks[x].time_until_run = offset;
-		periodic_tasks[x].last_check_time = Now();
-		periodic_tasks[x].arg = arg;
-		Kernel_Create_Task_At(&periodic_tasks[x], f, pid_index);
-        Enter_Kernel();
-    }
-	return (PID)pid_index;
+	Enable_Interrupt();
+	return id;
 }
 
-PID Task_Create_System(voidfuncptr f, int arg)
+void Sem_Wait(SEMAPHORE id)
 {
-	int x;
-	for (x = 0; x < MAXPROCESS; x++)
-	{
-		if (system_tasks[x].state == DEAD)
-		break;
+	SEMAPHORE_CB *s;
+
+	Disable_Interrupt();
+	s = Sem_Get(id);
+	if (s->count > 0) {
+		--s->count;
+		Enable_Interrupt();
+		return;
 	}
-    if (KernelActive)
-    {
-        Disable_Interrupt();
-        system_tasks[x].request = NONE;
-        system_tasks[x].priority = SYSTEM;
-        system_tasks[x].code = f;
-        system_tasks[x].pid = pid_index++;
-		system_tasks[x].arg = arg;
-		Kernel_Create_Task_At(&system_tasks[x], f, pid_index);
-        Enter_Kernel();
-    }
-    else
-    {
-        /* call the RTOS function directly */
-        Kernel_Create_Task(f, SYSTEM, pid_index++);
-    }
-	return (PID)pid_index;
+	Cp->state = SEMBLOCK;
+	Cp->request = WAITING;
+	Wait_Push(&s->waiters, (PD *)Cp);
+	Enter_Kernel();
 }
 
-void Task_Create_Idle()
+void Sem_Signal(SEMAPHORE id)
 {
-	Kernel_Create_Task(&idle, IDLE, pid_index++);
+	SEMAPHORE_CB *s;
+	PD *p;
+
+	Disable_Interrupt();
+	s = Sem_Get(id);
+	p = Wait_Pop(&s->waiters);
+	if (p == NULL) {
+		++s->count;
+		Enable_Interrupt();
+		return;
+	}
+	Ready(p);
+	p->request = NONE;
+	if (p->level <= Cp->level) {
+		Enable_Interrupt();
+		return;
+	}
+	Enter_Kernel();
 }
+#endif
 
+#ifdef EVENT_GROUPS
+static EVENT_GROUP_CB *Event_Get(EVENT_GROUP id)
+{
+	if (id == 0 || id > event_group_count) {
+		abort_pid = Cp->pid;
+		OS_Abort(SYNC_NOT_FOUND);
+	}
+	return &event_groups[id - 1];
+}
 
 /**
-  * The calling task gives up its share of the processor voluntarily.
+  * TRUE if "flags" satisfy a wait for "bits" in "mode".
   */
-void Task_Next()
+static BOOL Event_Satisfied(unsigned int flags, unsigned int bits, uint8_t mode)
 {
-    if (KernelActive)
-    {
-        Disable_Interrupt();
-        Cp->request = NEXT;
-		if(Cp->priority == PERIODIC) {
-			Cp->state = SUSPENDED;
-			Cp->request = WAITING;
-		}
-        Enter_Kernel();
-    }
+	return (mode & EVENT_ALL) ? (flags & bits) == bits : (flags & bits) != 0;
 }
 
-int Task_GetArg(void)
+/**
+  * Sets "bits" in g and wakes up every waiter they satisfy. The bits that
+  * EVENT_CLEAR waiters consume are only cleared once all the waiters have
+  * seen them. Returns TRUE if a task of a higher level than Cp woke up.
+  * Called with interrupts disabled.
+  */
+static BOOL Event_Post(EVENT_GROUP_CB *g, unsigned int bits)
 {
-	return Cp->arg;
+	PD *prev = NULL;
+	PD *p = g->waiters.head;
+	unsigned int clear = 0;
+	BOOL preempt = FALSE;
+
+	g->flags |= bits;
+	while (p != NULL) {
+		PD *next = p->next;
+
+		if (Event_Satisfied(g->flags, p->events, p->event_mode)) {
+			Queue_Remove(&g->waiters, prev, p);
+			if (p->event_mode & EVENT_CLEAR) {
+				clear |= p->events;
+			}
+			p->events = g->flags;
+			Ready(p);
+			p->request = NONE;
+			if (p->level > Cp->level) {
+				preempt = TRUE;
+			}
+		} else {
+			prev = p;
+		}
+		p = next;
+	}
+	g->flags &= ~clear;
+	return preempt;
 }
 
-int Match_Send(PID id, MTYPE t){
-	if (pid_to_pd[id]->state == RCVBLOCK){
-		if ((t & pid_to_pd[id]->mask) != 0){
-			return 1;
+/**
+  * Wakes up the waiters that the flags set by interrupt handlers since the
+  * last kernel entry satisfy. Called by the scheduler on every kernel entry.
+  */
+static void Event_Deliver()
+{
+	uint8_t x;
+
+	for (x = 0; events_posted != 0; x++) {
+		if (events_posted & (1 << x)) {
+			events_posted &= ~(1 << x);
+			Event_Post(&event_groups[x], 0);
 		}
 	}
-	return 0;
-};
+}
+
+EVENT_GROUP Event_Init(void)
+{
+	EVENT_GROUP id = 0;
 
-void Msg_Send(PID id, MTYPE t, unsigned int *v)
-{	
 	Disable_Interrupt();
-	if (pid_to_pd[id] == NULL){
-		OS_Abort(PID_NOT_FOUND);
-	}
-	if (Match_Send(id, t))
-	{
-		pid_to_pd[id]->msg = *v;
-		pid_to_pd[id]->msg_pid = Cp->pid;
-		pid_to_pd[id]->state = READY;
-		pid_to_pd[id]->request = NONE;
-		Cp->state = RPYBLOCK;
-		Cp->request = WAITING;
-	}
-	else
-	{
-		Cp->msg_pid = id;
-		Cp->mask = (MASK)t;
-		Cp->msg = *v;
-		Cp->state = SNDBLOCK;
-		Cp->request = WAITING;
+	if (event_group_count < MAXEVENTGROUP) {
+		id = ++event_group_count;
 	}
-	Enter_Kernel();
+	Enable_Interrupt();
+	return id;
 }
 
-PID Msg_Recv(MASK m, unsigned int *v)
+unsigned int Event_Wait(EVENT_GROUP id, unsigned int bits, uint8_t mode)
 {
+	EVENT_GROUP_CB *g;
+	unsigned int flags;
+
 	Disable_Interrupt();
-	Cp->mask = m;
-	Cp->state = RCVBLOCK;
+	g = Event_Get(id);
+	if (Event_Satisfied(g->flags, bits, mode)) {
+		flags = g->flags;
+		if (mode & EVENT_CLEAR) {
+			g->flags &= ~bits;
+		}
+		Enable_Interrupt();
+		return flags;
+	}
+	Cp->events = bits;
+	Cp->event_mode = mode;
+	Cp->state = EVTBLOCK;
 	Cp->request = WAITING;
+	Queue_Push_Back(&g->waiters, (PD *)Cp);
 	Enter_Kernel();
-
-	*v = Cp->msg;
-	pid_to_pd[Cp->msg_pid]->request = WAITING;
-	pid_to_pd[Cp->msg_pid]->state = RPYBLOCK;
-	return Cp->msg_pid;
+	return Cp->events;
 }
 
-void Msg_Rply(PID id, unsigned int r)
+/**
+  * Only enters the kernel if a task it wakes up outranks the caller.
+  */
+void Event_Set(EVENT_GROUP id, unsigned int bits)
 {
 	Disable_Interrupt();
-	// kind of assuming that the only way to get to reply is from a successful send
-	// therefore the sender must already be in RPYBLOCK, no need to check.
-	if (pid_to_pd[id]->state == RPYBLOCK){
-		pid_to_pd[id]->msg = r;
-		pid_to_pd[id]->state = READY;
-		pid_to_pd[id]->request = NONE;
+	if (!Event_Post(Event_Get(id), bits)) {
+		Enable_Interrupt();
+		return;
 	}
 	Enter_Kernel();
 }
 
-void Msg_ASend(PID id, MTYPE t, unsigned int v)
+/**
+  * Event_Set() for interrupt handlers, which run with interrupts disabled:
+  * it only sets "bits", and leaves waking the waiters to the next kernel
+  * entry, i.e., at once if the CPU was idle, or else on the next TICK.
+  */
+void Event_Set_ISR(EVENT_GROUP id, unsigned int bits)
 {
-	Disable_Interrupt();
-	if (Match_Send(id, t))
-	{
-		pid_to_pd[id]->msg = v;
-		pid_to_pd[id]->msg_pid = 0;
-		pid_to_pd[id]->state = READY;
-		pid_to_pd[id]->request = NONE;
+	if (id == 0 || id > event_group_count) {
+		return;
 	}
-	Enter_Kernel();
+	event_groups[id - 1].flags |= bits;
+	events_posted |= 1 << (id - 1);
+}
+
+void Event_Clear(EVENT_GROUP id, unsigned int bits)
+{
+	Disable_Interrupt();
+	Event_Get(id)->flags &= ~bits;
+	Enable_Interrupt();
+}
+
+unsigned int Event_Flags(EVENT_GROUP id)
+{
+	unsigned int flags;
+
+	Disable_Interrupt();
+	flags = Event_Get(id)->flags;
+	Enable_Interrupt();
+	return flags;
 }
+#endif
 
 /**
   * The calling task terminates itself.
@@ -786,6 +3811,7 @@ void Task_Terminate()
     }
 }
 
+#ifndef OS_HOST
 // NOTE: do not touch this code
 // adding pretty much any line of code to this ISR
 // will break the entire program
@@ -793,40 +3819,32 @@ ISR(TIMER4_COMPA_vect)
 {
     asm("jmp Enter_Kernel_Interrupt" ::);
 }
+#endif
 
 /*============
   * A Simple Test 
   *============
   */
 
+/**
+  * A "Ping" task: its argument is the PID of the "Pong" task it sends to.
+  */
 void Ping()
 {
-    int x, y;
+    PID pong = Task_GetArg();
+
     DDRB = 0xff;
     for (;;)
     {
         //LED on
 		unsigned int a = 5;
-		Msg_Send(2, 1, &a);
+		Msg_Send(pong, 1, &a);
         PORTB = 0xff;
-        for (y = 0; y < 32; ++y)
-        {
-            for (x = 0; x < 32000; ++x)
-            {
-                asm("");
-            }
-        }
+        Task_Sleep(400 / MSECPERTICK);
 
         //LED off
         PORTB = 0;
-
-        for (y = 0; y < 32; ++y)
-        {
-            for (x = 0; x < 32000; ++x)
-            {
-                asm("");
-            }
-        }
+        Task_Sleep(400 / MSECPERTICK);
 
         /* printf( "*" );  */
     }
@@ -894,8 +3912,7 @@ int main()
     OS_Init();
 	Task_Create_Idle();
 	// Task_Create_System(Task_Init, 0);
-    // Task_Create_RR(Pong, 0);
-    // Task_Create_RR(Ping, 0);
+    // Task_Create_RR(Ping, Task_Create_RR(Pong, 0));
 	#ifdef TESTING
 	Task_Create_System(test_main, 0);
 	#endif
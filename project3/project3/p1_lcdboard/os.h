@@ -1,10 +1,17 @@
 /* Last modified: MHMC Jan/30/2018 */
 #ifndef _OS_H_  
 #define _OS_H_  
+
+#include <stdint.h>
    
 #define MAXTHREAD     16       
-#define WORKSPACE     256   // in bytes, per THREAD
+#ifndef WORKSPACE
+#define WORKSPACE     256   // default stack size in bytes, per THREAD
+#endif
 #define MSECPERTICK   10   // resolution of a system TICK in milliseconds
+#ifndef BUF_SIZE
+#define BUF_SIZE      16   // size of a message buffer in bytes, see Buf_Alloc()
+#endif
 
 #ifndef NULL
 #define NULL          0   /* undefined */
@@ -14,11 +21,15 @@
 
 #define ANY           0xFF       // a mask for ALL message type
 
-typedef unsigned int PID;        // always non-zero if it is valid
-typedef unsigned int TICK;       // 1 TICK is defined by MSECPERTICK
+typedef unsigned int PID;        // always non-zero if it is valid; stale once its task dies
+typedef uint16_t TICK;           // 1 TICK is defined by MSECPERTICK
 typedef unsigned int BOOL;       // TRUE or FALSE
 typedef unsigned char MTYPE;
 typedef unsigned char MASK;
+typedef unsigned int MUTEX;      // always non-zero if it is valid
+typedef unsigned int SEMAPHORE;  // always non-zero if it is valid
+typedef unsigned int EVENT_GROUP;  // always non-zero if it is valid
+typedef unsigned int SOFT_TIMER;   // always non-zero if it is valid
 
 typedef void (*voidfuncptr)(void); /* pointer to void f(void) */
 
@@ -41,6 +52,11 @@ void OS_Abort(unsigned int error);
  * When a Periodic task is preempted, it is put on hold until all higher priority tasks
  * are no longer ready. However, when it is resumed later, a timing violation occurs if
  * another Periodic becomes ready, i.e., there is a timing conflict. The RTOS may abort.
+ * The above is the default PERIODIC_FIFO policy. When the kernel is built with
+ * PERIODIC_POLICY set to PERIODIC_EDF (earliest deadline first) or PERIODIC_RM (rate
+ * monotonic), Periodic tasks may overlap instead: a newly released job with an earlier
+ * deadline (EDF) or a shorter period (RM) preempts the running one at the next TICK,
+ * and the RTOS only aborts when a job has not finished by its next release.
  * System and RR tasks are first-come-first-served. They run until they terminate, block,
  * or yield. RR tasks, on the other hand, run until they expire their quantum, or are
  * pre-empted. If they are preempted, then reenter at the front of their level. If they
@@ -48,6 +64,10 @@ void OS_Abort(unsigned int error);
  * is defined to be 1 TICK.
  */
 
+//
+// Task_Create_System() and Task_Create_RR() return the new task's PID, or 0 if every
+// PD of its level is taken, like Task_Create_Period().
+//
 PID   Task_Create_System(voidfuncptr f, int arg);
 PID   Task_Create_RR(    voidfuncptr f, int arg);
 
@@ -55,12 +75,108 @@ PID   Task_Create_RR(    voidfuncptr f, int arg);
    * f a parameterless function to be created as a process instance
    * arg an integer argument to be assigned to this process instanace
    * period its execution period in multiples of TICKs
-   * wcet its worst-case execution time in TICKs, must be less than "period"
+   * wcet its worst-case execution time in TICKs, must be less than "period";
+   *      0 for a job that takes well under a TICK, which reserves no time in
+   *      admission control (see ADMISSION_CONTROL in os.c) and is only checked
+   *      against its next release, since a TICK is too coarse to time it
    * offset its start time in TICKs
    * returns 0 if not successful; otherwise a non-zero PID.
    */
 PID   Task_Create_Period(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset);
 
+//
+// When admission control (see ADMISSION_CONTROL in os.c) refuses a Periodic task, because
+// the periodic task set would no longer be feasible, Task_Create_Period() and its
+// variants return 0 and use up nothing. Task_Admission_Error() then returns the error
+// code of the refusal (UTILIZATION_EXCEEDED or RELEASE_COLLISION), which may be passed
+// to OS_Abort() to fail at startup; it returns 0 if the last Periodic task was admitted.
+//
+unsigned int Task_Admission_Error(void);
+
+//
+// The Task_Create_*_Stack() variants give the new task a stack of "stack" bytes
+// instead of the default WORKSPACE. Stacks are carved out of a single arena in
+// the kernel; use Task_Stack_Used() to size them from measured high-water marks.
+//
+PID   Task_Create_System_Stack(voidfuncptr f, int arg, unsigned int stack);
+PID   Task_Create_RR_Stack(    voidfuncptr f, int arg, unsigned int stack);
+PID   Task_Create_Period_Stack(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset, unsigned int stack);
+
+//
+// Task_Create_Job() makes a Periodic task that runs to completion: "f" is called once
+// per job, and returning from it ends the job as Task_Next() would. Such tasks have no
+// stack of their own. Those that can never preempt each other share one (see JOB_STACKS
+// in os.c): all of them under PERIODIC_FIFO, and those with the same period under EDF
+// and RM. A job must not block, sleep, or lock a mutex, and its local variables do not
+// survive into the next job. A job that runs over is never demoted; OVERRUN_DEMOTE
+// aborts instead. Task_Terminate() from within a job ends the task for good.
+//
+PID   Task_Create_Job(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset);
+void  Task_Terminate(void);
+
+//
+// Lightweight tasks (LWTs) are Periodic protothreads. Each one is just an LWT control block,
+// and all of them run on the stack of a single runner task, at the Periodic level. An LWT
+// is a function that runs one job per call, picking up where the last job left off:
+//
+//   uint8_t blink(LWT *t)
+//   {
+//       LWT_BEGIN(t);
+//       for (;;) {
+//           PORTB ^= 0x80;
+//           LWT_NEXT(t);    // the job is done; the next one resumes here
+//       }
+//       LWT_END(t);
+//   }
+//
+// Lwt_Create_Period() releases it every "period" TICKs from "offset" TICKs on, and returns
+// NULL if MAXLWT LWTs (see os.c) already exist. The LWT ends at LWT_END(). Its local
+// variables do not survive LWT_NEXT(), which must not be used inside a switch statement.
+// An LWT must not block or call Task_Next(), since the other LWTs would wait with it,
+// nor lock a mutex. Its jobs are not timed like those of Periodic tasks, and LWTs take no
+// part in admission control, but each job is ordered among the Periodic jobs by the
+// periodic policy, as if it were one of them.
+//
+typedef struct Lwt LWT;
+typedef uint8_t (*lwtfuncptr)(LWT *t);
+
+struct Lwt {
+	uint16_t lc;          // where the next job resumes, 0 at the start
+	int arg;              // Lwt_Create_Period()'s "arg"
+	lwtfuncptr code;      // the rest belongs to the kernel
+	TICK period;
+	TICK release;
+	struct Lwt *next;
+};
+
+#define LWT_WAITING   0   // an LWT function's result: run the next job next period
+#define LWT_ENDED     1   // an LWT function's result: the LWT is done
+
+#define LWT_BEGIN(t)  switch ((t)->lc) { case 0:
+#define LWT_NEXT(t)   do { (t)->lc = __LINE__; return LWT_WAITING; case __LINE__:; } while (0)
+#define LWT_END(t)    } (t)->lc = 0; return LWT_ENDED
+
+LWT  *Lwt_Create_Period(lwtfuncptr f, int arg, TICK period, TICK offset);
+
+//
+// Software timers call "f(arg)" from the kernel's timer task, a System task, "period" TICKs
+// after Soft_Timer_Start(): once (SOFT_TIMER_ONE_SHOT), or every "period" TICKs until
+// Soft_Timer_Stop() (SOFT_TIMER_AUTO_RELOAD). Soft_Timer_Create() returns 0 when the kernel
+// has none left (see MAXSOFTTIMER in os.c); they are never freed. Starting a timer that is
+// already running restarts it, and stopping one also cancels a callback that is still due.
+// Callbacks run one at a time, so they must be short, and they must not block; they may
+// start and stop timers, their own included. Interrupt handlers must not use timers.
+//
+typedef void (*timerfuncptr)(int arg);
+
+#define SOFT_TIMER_ONE_SHOT     0
+#define SOFT_TIMER_AUTO_RELOAD  1
+
+SOFT_TIMER Soft_Timer_Create(timerfuncptr f, int arg, TICK period, uint8_t mode);
+void       Soft_Timer_Start(SOFT_TIMER t);
+void       Soft_Timer_Stop(SOFT_TIMER t);
+BOOL       Soft_Timer_Active(SOFT_TIMER t);
+
 // NOTE: When a task function returns, it terminates automatically!!
 
 // When a Periodic ask calls Task_Next(), it will resume at the beginning of its next period.
@@ -69,6 +185,32 @@ PID   Task_Create_Period(voidfuncptr f, int arg, TICK period, TICK wcet, TICK of
 //   
 void Task_Next(void);
 
+// The calling task sleeps for "t" TICKs without using the processor. Task_Sleep(0) is a
+// Task_Next() that a Periodic task may also use without ending its current period.
+void Task_Sleep(TICK t);
+
+
+// What the RTOS does when a Periodic job breaks its timing, i.e., under PERIODIC_FIFO when
+// it is still running "wcet" TICKs after its release (or its next release, if "wcet" is 0),
+// and otherwise when it has not finished by its next release:
+//   OVERRUN_ABORT   abort the RTOS (the default)
+//   OVERRUN_SKIP    let the job finish in place of the next one, whose release is skipped
+//                   (and any other it runs into); it is not checked again
+//   OVERRUN_SHIFT   let the job finish as if released now; later releases shift with it
+//   OVERRUN_DEMOTE  let the job finish, and the task carry on, as a RR task
+// Under the cyclic executive, releases always stay on the table.
+// Task_Violations() returns how many violations task "id" has been let off with.
+//
+typedef enum {
+	OVERRUN_ABORT = 0,
+	OVERRUN_SKIP,
+	OVERRUN_SHIFT,
+	OVERRUN_DEMOTE
+} OVERRUN_POLICY;
+
+void Task_Overrun_Policy(PID id, OVERRUN_POLICY policy);
+unsigned int Task_Violations(PID id);
+
 
 // The calling task gets its initial "argument" when it was created.
 int  Task_GetArg(void);
@@ -83,24 +225,153 @@ PID  Task_Pid(void);
 // Rply() to a NULL process is a no-op.
 // See: http://www.qnx.com/developers/docs/6.5.0/index.jsp?topic=%2Fcom.qnx.doc.neutrino_sys_arch%2Fipc.html
 //
-// Note: PERIODIC tasks are not allowed to use Msg_Send() or Msg_Recv().
+// Note: PERIODIC tasks should not use Msg_Send() or Msg_Recv(): a job blocked in them
+// still has to finish before its next release.
+// If "id" terminates before it has received the message, Msg_Send() returns with "*v"
+// unchanged.
 //
 void Msg_Send( PID  id, MTYPE t, unsigned int *v );
 PID  Msg_Recv( MASK m,           unsigned int *v );
 void Msg_Rply( PID  id,          unsigned int r );
 
+//
+// Timed variants: they return FALSE, and leave "*v" as it was, if they have waited "timeout"
+// TICKs in vain (0 means do not wait at all). Msg_Send_Timeout() only times out while "id" has
+// not yet received the message; once "id" has, it waits for the reply as long as it takes.
+// Msg_Send_Timeout() also returns FALSE if "id" terminates before receiving the message.
+// Msg_Recv_Timeout() returns the sender's PID in "*from".
+//
+BOOL Msg_Send_Timeout( PID  id, MTYPE t, unsigned int *v,             TICK timeout );
+BOOL Msg_Recv_Timeout( MASK m,           unsigned int *v, PID *from,  TICK timeout );
+
+//
+// Server loops: Msg_Rply_Recv() replies "r" to "id" and then receives the next message
+// like Msg_Recv(), with a single kernel entry. A task woken up by a message or a reply
+// runs straight away if it is of a higher level than the caller, or, when the caller
+// blocks, ahead of the other tasks of its level.
+//
+PID  Msg_Rply_Recv( PID id, unsigned int r, MASK m, unsigned int *v );
+
+//
+// Zero-copy messages: Buf_Alloc() takes a BUF_SIZE-byte buffer from the kernel's pool
+// (NULL if none is free) and makes the calling task its owner. Msg_Send_Buf() lends
+// buffer "b" and "*len" to "id": "id" owns it from its Recv() until its Rply(), which
+// gives it back to the sender and leaves the reply in "*len". Msg_Recv_Buf() returns
+// the lent buffer in "*b", or NULL for a message without one. Only the owner of a buffer
+// may use it, send it, reply with it or Buf_Free() it; a task that does otherwise is
+// aborted. Buffers still owned by a task when it terminates go back to the pool.
+//
+void *Buf_Alloc( void );
+void  Buf_Free( void *b );
+void  Msg_Send_Buf( PID id, MTYPE t, void *b,  unsigned int *len );
+PID   Msg_Recv_Buf( MASK m,          void **b, unsigned int *len );
+
 //
 // Asychronously Send a message "v" of type "t" to "id". The task "id" must be blocked on
 // Recv() state, otherwise it is a no-op. After passing "v" to "id", the returned PID of
 // Recv() is NULL (non-existent); thus, "id" doesn't need to reply to this message.
 // Note: The message type "t" must satisfy the MASK "m" imposed by "id". If not, then it
-// is a no-op.
+// is a no-op. So is a message to a PID whose task has terminated.
+// When the kernel is built with MAILBOXES, a message that "id" is not waiting for is
+// kept in its mailbox instead, and the next Recv() with a matching MASK returns it at
+// once. When the mailbox is full, the message is dropped and counted in Msg_Overflows().
 //
 // Note: PERIODIC tasks (or interrupt handlers), however, may use Msg_ASend()!!!
+// Interrupt handlers must use Msg_ASend_ISR(), which does not enter the kernel: a task it
+// wakes up runs at once if the CPU was idle, and otherwise on the next TICK.
 //
 void Msg_ASend( PID  id, MTYPE t, unsigned int v );
+void Msg_ASend_ISR( PID id, MTYPE t, unsigned int v );
+unsigned int Msg_Overflows( PID id );
+
+
+
+//
+// Mutexes and counting semaphores, which all tasks, PERIODIC ones included, may use.
+// Mutex_Init() and Sem_Init() return 0 when the kernel has none left; they are never
+// freed. Mutex_Lock() blocks while another task holds "m"; the holder then inherits the
+// level (System, Periodic or RR) of the highest task waiting, so that it cannot be held
+// up by the tasks in between. A task must not lock a mutex it already holds, nor unlock
+// one it does not hold; the RTOS aborts if it does. Mutexes still held when a task
+// terminates are unlocked. Sem_Wait() blocks while the count of "s" is 0. Waiters are
+// woken highest level first, and in FIFO order within a level.
+// Note: inheritance is between levels only; a Periodic holder keeps its own place among
+// the Periodic tasks under PERIODIC_EDF or PERIODIC_RM.
+//
+MUTEX     Mutex_Init( void );
+void      Mutex_Lock( MUTEX m );
+void      Mutex_Unlock( MUTEX m );
+SEMAPHORE Sem_Init( unsigned int count );
+void      Sem_Wait( SEMAPHORE s );
+void      Sem_Signal( SEMAPHORE s );
+
+//
+// Event groups: each one is a set of event flags, one per bit. Event_Init() returns 0
+// when the kernel has none left; they are never freed. Event_Wait() blocks until any
+// (EVENT_ANY) or all (EVENT_ALL) of the non-zero "bits" are set in "g", and returns the
+// flags as they were then. With EVENT_CLEAR added to "mode", it also clears "bits" on
+// its way out. Event_Set() sets "bits" and wakes every waiter that they satisfy. Like
+// semaphores, event groups may be used by all tasks.
+// Interrupt handlers must use Event_Set_ISR(), which sets "bits" at once but does not
+// enter the kernel: a task they satisfy wakes up at the next kernel entry, i.e., at once
+// if the CPU was idle, and otherwise on the next TICK. It ignores an invalid "g".
+//
+#define EVENT_ANY    0x00
+#define EVENT_ALL    0x01
+#define EVENT_CLEAR  0x02
+
+EVENT_GROUP  Event_Init( void );
+unsigned int Event_Wait( EVENT_GROUP g, unsigned int bits, uint8_t mode );
+void         Event_Set( EVENT_GROUP g, unsigned int bits );
+void         Event_Set_ISR( EVENT_GROUP g, unsigned int bits );
+void         Event_Clear( EVENT_GROUP g, unsigned int bits );
+unsigned int Event_Flags( EVENT_GROUP g );
+
+
+
+
+//
+// Stack usage: every task stack is filled with a known pattern when the task is
+// created. Task_Stack_Used() returns the deepest stack usage, in bytes, that task
+// "id" has reached so far (its high-water mark), or 0 if "id" is not a live task.
+// OS_Stack_Dump() writes the high-water mark of every live task to UART0, which
+// must already be initialized by the caller.
+//
+unsigned int Task_Stack_Used(PID id);
+void OS_Stack_Dump(void);
 
 
+//
+// Execution-time statistics (when the kernel is built with EXEC_STATS). A job is what a
+// task runs between getting the CPU and giving it up of its own accord, by Task_Next(),
+// by blocking or by terminating; for a Periodic task it lasts until Task_Next(), as
+// one period's work. Job times only count the time the task actually had the CPU.
+// Task_Stats() copies the statistics of task "id" into "*s", or returns FALSE if "id"
+// is not a live task or the kernel keeps no statistics. Use exec_max to choose the
+// "wcet" of a Periodic task.
+//
+typedef struct {
+	uint32_t jobs;             // jobs finished so far
+	uint32_t exec_min;         // shortest job, in microseconds
+	uint32_t exec_avg;         // mean job, in microseconds
+	uint32_t exec_max;         // longest job, in microseconds
+	uint32_t preemptions;      // times a job lost the CPU to another task
+	uint16_t overruns;         // Periodic jobs that ran longer than "wcet"
+	uint16_t deadline_misses;  // Periodic jobs that ended after their next release
+} TASK_STATS;
+
+BOOL Task_Stats(PID id, TASK_STATS *s);
+
+
+//
+// Context-switch trace (when the kernel is built with KERNEL_TRACE): create
+// OS_Trace_Drain() as a low-priority RR task, after initializing UART0, to
+// stream every recorded switch in and out of a task with its reason and a
+// TCNT4 timestamp. The drain task's own switches are not recorded, and it sleeps
+// while there is nothing to send, so it does not keep the idle task from running.
+//
+void OS_Trace_Drain(void);
+
 
 /**  
   * Returns the number of milliseconds since OS_Init(). Note that this number
@@ -113,10 +384,15 @@ void Msg_ASend( PID  id, MTYPE t, unsigned int v );
   * then (Now() - T >= 1000) would mean we have reached T+1000.
   * However, we cannot compare Now() against T directly due to this wrap-around
   * behaviour.
-  * Now() will wrap around every 65536 milliseconds. Therefore, for measurement
-  * purposes, it should be used for durations less than 65 seconds.
+  * Now() is 32 bits wide and wraps around every 2^32 milliseconds, i.e., after
+  * about 49 days. It reads the running TIMER4 count, so it advances within a TICK.
+  * Now_us() is the same in microseconds, with TIMER4's resolution of 16 us; it
+  * wraps around every 2^32 microseconds, i.e., after about 71 minutes, so it is
+  * meant for durations shorter than that (execution times, jitter, latencies).
+  * Both may be called from tasks and interrupt handlers alike.
   */
-unsigned int Now();  // number of milliseconds since the RTOS boots.
+uint32_t Now(void);     // number of milliseconds since the RTOS boots.
+uint32_t Now_us(void);  // number of microseconds since the RTOS boots.
 
 
 /*==================================================================  
@@ -26,6 +26,9 @@
 #define DOCK  143   // force the Roomba to seek its dock.
 #define STOP 173
 
+#define SMALL_STACK 128 // stack for tasks that make no library calls
+#define ESCAPE_TICKS 150 // length of each half of the escape manoeuvre
+
 extern void lcd_task();
 
 static uint8_t analog_reference = DEFAULT;
@@ -40,6 +43,12 @@ static uint16_t light_sensor;
 static uint8_t roomba_alive = 1;
 static uint8_t move_switch = 1;
 static TICK laser_time; 
+static SOFT_TIMER escape_timer;
+
+// set by the RX interrupts of the two links, for receive_task
+static EVENT_GROUP rx_events;
+#define RX_BT     0x01  // UART1, from the control board
+#define RX_ROOMBA 0x02  // UART2, sensor packets from the Roomba
 
 int tpos = 1500;
 int ppos = 1500;
@@ -163,37 +172,41 @@ void laser_task() {
 	}
 }
 
-void escape_task() {
+// the escape manoeuvre: reverse for ESCAPE_TICKS, then turn right for as long
+void escape_step(int arg) {
+	if (escape_out == 'b') {
+		escape_out = 'r'; // turn right
+		Soft_Timer_Start(escape_timer);
+	} else {
+		escape_out = NULL;
+	}
+}
+
+uint8_t escape_task(LWT *t) {
+	LWT_BEGIN(t);
 	for(;;) {
-		if(rs.bumper_pressed || rs.vwall_detected) {
-			int i;
-			for(i = 0; i < 75; ++i) {
-				escape_out = 'b'; // reverse
-				Task_Next();
-			}
-			for(i = 0; i < 75; ++i) {
-				escape_out = 'r';
-				Task_Next(); // turn right
-			}
-			escape_out = NULL;
-		} else {
-			escape_out = NULL;
+		if(escape_out == NULL && (rs.bumper_pressed || rs.vwall_detected)) {
+			escape_out = 'b'; // reverse
+			Soft_Timer_Start(escape_timer);
 		}
-		
-		Task_Next();
+		LWT_NEXT(t);
 	}
+	LWT_END(t);
 }
 
-void cruise_task() {
+uint8_t cruise_task(LWT *t) {
+	LWT_BEGIN(t);
 	for(;;) {
 		cruise_out = 'f';
-		Task_Next();
+		LWT_NEXT(t);
 	}
+	LWT_END(t);
 }
 
 
 
-void user_ai_task() {
+uint8_t user_ai_task(LWT *t) {
+	LWT_BEGIN(t);
 	for(;;) {
 		if(sdata.state.rjs_y < 200) {
 			user_out = 'f';
@@ -211,11 +224,13 @@ void user_ai_task() {
 			user_out = NULL;
 			}
 		}
-		Task_Next();
+		LWT_NEXT(t);
 	}
+	LWT_END(t);
 }
 
-void choose_ai_routine() {
+uint8_t choose_ai_routine(LWT *t) {
+	LWT_BEGIN(t);
 	for(;;) {
 		if(escape_out != NULL) {
 			action_source = ESCAPE;
@@ -227,53 +242,73 @@ void choose_ai_routine() {
 			action_source = CRUISE;
 			current_action = cruise_out;
 		}
-		Task_Next();
+		LWT_NEXT(t);
+	}
+	LWT_END(t);
+}
+
+void uart1_rx_event(void) {
+	Event_Set_ISR(rx_events, RX_BT);
+}
+
+void uart2_rx_event(void) {
+	Event_Set_ISR(rx_events, RX_ROOMBA);
+}
+
+static void receive_bt() {
+	while (uart1_AvailableBytes() && uart1_peek() != '$') {
+		uart1_getc();
+	}
+	if (uart1_AvailableBytes() > sizeof(struct system_state)) {
+		uart1_getc();
+		for (int i = 0; i < sizeof(struct system_state); i++){
+			sdata.data[i] = uart1_getc();
+		}
+		//uart0_putc('\n');
+		//uart0_putint(sdata.state.rjs_x);
+		//uart0_putc('\n');
+		//uart0_putint(sdata.state.rjs_y);
+		//uart0_putc('\n');
+		//uart0_putint(sdata.state.rjs_z);
+		//uart0_putc('\n');
+		//
+		//uart0_putint(sdata.state.sjs_x);
+		//uart0_putc('\n');
+		//uart0_putint(sdata.state.sjs_y);
+		//uart0_putc('\n');
+		//uart0_putint(sdata.state.sjs_z);
+		//uart0_putc('\n');
+	}
+}
+
+static void receive_roomba() {
+	if (uart2_AvailableBytes() >= 2) {
+		// populate roomba state (rs) here
+		rs.bumper_pressed = uart2_getc();
+		rs.vwall_detected = uart2_getc();
 	}
 }
 
-void receive_bt() {
+// sleeps until the RX interrupts have buffered more bytes on either link,
+// instead of polling them every period; a packet that is not complete yet
+// stays in its buffer until the next byte wakes the task up again
+void receive_task() {
 	uart0_init(BAUD_CALC(9600));
 	uart1_init(BAUD_CALC(9600));
 	for(;;){
-		if (uart1_AvailableBytes() > sizeof(struct system_state)){
-			while (uart1_peek() != '$') {
-				if (uart1_AvailableBytes()) {
-					uart1_getc();
-				}
-				else {
-					Task_Next();
-				}
-			}
-			if (uart1_AvailableBytes() > sizeof(struct system_state)) {
-				uart1_getc();
-				for (int i = 0; i < sizeof(struct system_state); i++){
-					sdata.data[i] = uart1_getc();
-				}
-				//uart0_putc('\n');
-				//uart0_putint(sdata.state.rjs_x);
-				//uart0_putc('\n');
-				//uart0_putint(sdata.state.rjs_y);
-				//uart0_putc('\n');
-				//uart0_putint(sdata.state.rjs_z);
-				//uart0_putc('\n');
-				//
-				//uart0_putint(sdata.state.sjs_x);
-				//uart0_putc('\n');
-				//uart0_putint(sdata.state.sjs_y);
-				//uart0_putc('\n');
-				//uart0_putint(sdata.state.sjs_z);
-				//uart0_putc('\n');
-			}
+		unsigned int rx = Event_Wait(rx_events, RX_BT | RX_ROOMBA, EVENT_ANY | EVENT_CLEAR);
+
+		if (rx & RX_BT) {
+			receive_bt();
+		}
+		if (rx & RX_ROOMBA) {
+			receive_roomba();
 		}
-		Task_Next();
 	}
 }
 
-void move_switch_task(){
-	for (;;){
+void move_switch_toggle(int arg){
 	move_switch ^= 1;
-	Task_Next();
-	}
 }
 
 void roomba_task() {
@@ -343,36 +378,59 @@ void roomba_task() {
 				break;
 		}
 		
+		// the reply is read by receive_task
 		uart2_putc(149);
 		uart2_putc(2);
 		uart2_putc(7);
 		uart2_putc(13);
-		char packet1 = 0;
-		char packet2 = 0;
-		Task_Next();
-		if (uart2_AvailableBytes()) {
-			// populate roomba state (rs) here
-			rs.bumper_pressed = uart2_getc();
-			rs.vwall_detected = uart2_getc();	
-		}
 		Task_Next();
 	}
 	
 }
 
+// a periodic task that admission control refuses stops the board at startup,
+// blinking the reason, rather than leaving the task out
+static PID admitted(PID pid) {
+	if (pid == 0) {
+		OS_Abort(Task_Admission_Error());
+	}
+	return pid;
+}
+
 void a_main() {
+	PID pid;
 	laser_time = 30000 / (MSECPERTICK * LASER_PERIOD);
 	analogReference(DEFAULT);
-	Task_Create_Period(laser_task, 0, LASER_PERIOD, 10, 1);
-	Task_Create_Period(escape_task, 0, 2, 1, 2);
-	Task_Create_Period(user_ai_task, 0, 2, 1, 3);
-	Task_Create_Period(cruise_task, 0, 2, 1, 4);
-	Task_Create_Period(choose_ai_routine, 0, 2, 1, 5);
-	Task_Create_Period(receive_bt, 0, 3, 1, 0);
-	Task_Create_Period(roomba_task, 0, 5, 1000, 0);
-	Task_Create_Period(move_switch_task, 0, 6000, 10000, 6000);
-	Task_Create_Period(servo_task, 0, 3, 10, 1);
-	Task_Create_Period(light_sensor_read, 0, 10, 10, 0);
+	// tasks that only touch globals get small stacks; the ones calling into
+	// the ADC and UART helpers keep the default WORKSPACE
+	// NOTE: the wcets below are not measured. Every job is expected to take
+	// well under a TICK, so each is given a wcet of 0: admission control
+	// then only checks that no two of them own a TICK (none does), and a
+	// job only counts as late once it runs into its next release. The
+	// coprime periods 3 and 10 leave no room for a wcet of a whole TICK under
+	// PERIODIC_FIFO; measure exec_max with EXEC_STATS before relying on it.
+	admitted(Task_Create_Period_Stack(laser_task, 0, LASER_PERIOD, 0, 1, SMALL_STACK));
+	// the action selection is a few assignments per job: lightweight tasks,
+	// which share one stack; the escape manoeuvre and the move switch are
+	// timed by software timers, whose callbacks share the timer task's
+	escape_timer = Soft_Timer_Create(escape_step, 0, ESCAPE_TICKS, SOFT_TIMER_ONE_SHOT);
+	Lwt_Create_Period(escape_task, 0, 2, 2);
+	Lwt_Create_Period(user_ai_task, 0, 2, 3);
+	Lwt_Create_Period(cruise_task, 0, 2, 4);
+	Lwt_Create_Period(choose_ai_routine, 0, 2, 5);
+	// the links are read as bytes come in, with the CPU the periodic tasks
+	// leave over; under a transient overload the Roomba commands and the
+	// servos carry on with a late job, skipping a period, rather than
+	// resetting the robot. roomba_task still sends a command and a sensor
+	// query every 10 TICKs.
+	rx_events = Event_Init();
+	Task_Create_RR(receive_task, 0);
+	pid = admitted(Task_Create_Period(roomba_task, 0, 10, 0, 0));
+	Task_Overrun_Policy(pid, OVERRUN_SKIP);
+	Soft_Timer_Start(Soft_Timer_Create(move_switch_toggle, 0, 6000, SOFT_TIMER_AUTO_RELOAD));
+	pid = admitted(Task_Create_Period_Stack(servo_task, 0, 3, 0, 1, SMALL_STACK));
+	Task_Overrun_Policy(pid, OVERRUN_SKIP);
+	admitted(Task_Create_Period(light_sensor_read, 0, 10, 0, 0));
 }
 
 
@@ -4,6 +4,7 @@
 #ifdef TESTING
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <string.h>
 #include <util/delay.h>
 #include "UART/usart.h"
@@ -13,6 +14,9 @@
 
 unsigned char results[BUFFER_SIZE]; // use 1 kb of space for test results
 volatile uint16_t cur; // index of current character in buffer
+MUTEX mtx;
+SEMAPHORE sem;
+volatile uint8_t stats_done;
 
 void basic_RR_test();
 void write_out();
@@ -31,6 +35,74 @@ void srr_reciever();
 void srr_async_test();
 void asrr_sender();
 void asrr_reciever();
+void qrr_test();
+void qrr_reciever();
+void qrr_late_sender();
+void qrr_early_sender();
+void mbox_test();
+void mbox_reciever();
+void buf_test();
+void buf_sender();
+void buf_reciever();
+void mtx_test();
+void mtx_low();
+void mtx_high();
+void mtx_periodic();
+void tmo_test();
+void tmo_reciever();
+void tmo_sender();
+void dead_test();
+void dead_reciever();
+void dead_sender();
+void dead_timed_sender();
+void dead_reuse();
+void time_test();
+void stats_test();
+void stats_periodic();
+void stats_spinner();
+void overrun_test();
+void overrun_shift();
+void overrun_demote_setup();
+void overrun_demote();
+void overrun_untimed_setup();
+void overrun_untimed();
+void overrun_skip_setup();
+void overrun_skip();
+void spin_us(uint32_t us);
+void hand_test();
+void hand_server();
+void hand_client();
+void hand_bystander();
+void lwt_test();
+uint8_t lwt_a(LWT *t);
+uint8_t lwt_b(LWT *t);
+void lwt_order_test();
+uint8_t lwt_order_l(LWT *t);
+void lwt_order_p();
+void job_test();
+void job_step();
+void churn_test();
+void churn_task();
+void churn_sleeper();
+void evt_test();
+void evt_any();
+void evt_all();
+void tmr_test();
+void tmr_fire(int arg);
+void admit_test();
+void admit_periodic();
+void admit_job();
+void phand_test();
+void phand_server();
+void phand_client();
+void phand_bystander();
+void phand_done();
+void slot_test();
+void slot_job();
+void slot_task();
+void isr_test();
+void isr_waiter();
+void isr_handler();
 
 
 void test_main() {
@@ -52,8 +124,8 @@ void basic_RR_test() {
 	}
 	results[cur++] = 0;
 	//Task_Create_System(srr_basic_test, 0);
-	Task_Create_Period(interleaved_periodic_task_1,0,10,100,0);
-	Task_Create_Period(interleaved_periodic_task_2,0,5,100,0);
+	Task_Create_Period(interleaved_periodic_task_1,0,10,0,0);
+	Task_Create_Period(interleaved_periodic_task_2,0,5,0,0);
 }
 
 
@@ -179,7 +251,7 @@ void asrr_sender(){
 	Task_Next();
 	results[cur++] = 'a';
 	results[cur++] = 0;
-	Task_Create_RR(write_out, 0);
+	Task_Create_System(qrr_test, 0);
 }
 
 void asrr_reciever(){
@@ -188,6 +260,139 @@ void asrr_reciever(){
 	results[cur++] = msg;
 }
 
+/*
+	senders that find the receiver busy queue up on it, and are
+	received in the order they sent
+	expected trace is c b
+*/
+void qrr_test(){
+	PID to = Task_Create_RR(qrr_reciever, 0);
+	Task_Create_RR(qrr_late_sender, to);
+	Task_Create_RR(qrr_early_sender, to);
+}
+
+void qrr_reciever(){
+	unsigned int msg;
+	PID from;
+	Task_Next(); // let both senders block on us
+	Task_Next();
+	from = Msg_Recv(0xff, &msg);
+	results[cur++] = msg;
+	Msg_Rply(from, 0);
+	from = Msg_Recv(0xff, &msg);
+	results[cur++] = msg;
+	Msg_Rply(from, 0);
+	results[cur++] = 0;
+	Task_Create_System(mbox_test, 0);
+}
+
+void qrr_late_sender(){
+	PID to = Task_GetArg();
+	unsigned int msg = 'b';
+	Task_Next();
+	Msg_Send(to, 1, &msg);
+}
+
+void qrr_early_sender(){
+	PID to = Task_GetArg();
+	unsigned int msg = 'c';
+	Msg_Send(to, 1, &msg);
+}
+
+/*
+	a burst of asynchronous messages to a task that is not yet
+	receiving waits in its mailbox (needs MAILBOXES in os.c)
+	expected trace is d e f
+*/
+void mbox_test(){
+	PID to = Task_Create_RR(mbox_reciever, 0);
+	Msg_ASend(to, 1, 'd');
+	Msg_ASend(to, 1, 'e');
+	Msg_ASend(to, 1, 'f');
+}
+
+void mbox_reciever(){
+	unsigned int msg;
+	int i;
+	for(i = 0; i < 3; ++i) {
+		Msg_Recv(0xff, &msg);
+		results[cur++] = msg;
+	}
+	results[cur++] = 0;
+	Task_Create_System(buf_test, 0);
+}
+
+/*
+	a buffer lent with Msg_Send_Buf() reaches the receiver without
+	copying and comes back, with what the receiver wrote into it,
+	on the reply (needs BUFFER_POOL in os.c)
+	expected trace is g h i
+*/
+void buf_test(){
+	PID to = Task_Create_RR(buf_reciever, 0);
+	Task_Create_RR(buf_sender, to);
+}
+
+void buf_sender(){
+	PID to = Task_GetArg();
+	unsigned char *buf = Buf_Alloc();
+	unsigned int len = 1;
+	buf[0] = 'g';
+	Msg_Send_Buf(to, 1, buf, &len);
+	results[cur++] = buf[0];
+	results[cur++] = len;
+	Buf_Free(buf);
+	results[cur++] = 0;
+	Task_Create_System(mtx_test, 0);
+}
+
+void buf_reciever(){
+	unsigned char *buf;
+	unsigned int len;
+	PID from = Msg_Recv_Buf(0xff, (void **)&buf, &len);
+	results[cur++] = buf[len - 1];
+	buf[0] = 'h';
+	Msg_Rply(from, 'i');
+}
+
+/*
+	a RR task holding a mutex that a system task waits for runs
+	at system level until it unlocks, ahead of a ready periodic
+	task; the periodic task then wakes it with a semaphore
+	(needs SYNC_OBJECTS in os.c)
+	expected trace is a b c d e f
+*/
+void mtx_test(){
+	mtx = Mutex_Init();
+	sem = Sem_Init(0);
+	Task_Create_RR(mtx_low, 0);
+}
+
+void mtx_low(){
+	Mutex_Lock(mtx);
+	results[cur++] = 'a';
+	Task_Create_System(mtx_high, 0);
+	results[cur++] = 'c';
+	Mutex_Unlock(mtx);
+	Sem_Wait(sem);
+	results[cur++] = 'f';
+	results[cur++] = 0;
+	Task_Create_System(tmo_test, 0);
+}
+
+void mtx_high(){
+	results[cur++] = 'b';
+	Task_Create_Period(mtx_periodic, 0, 10, 1, 0);
+	Mutex_Lock(mtx);
+	results[cur++] = 'd';
+	Mutex_Unlock(mtx);
+}
+
+void mtx_periodic(){
+	results[cur++] = 'e';
+	Sem_Signal(sem);
+}
+
 void write_out() {
 	uint16_t p;
 	uart_init(BAUD_CALC(115200));
@@ -203,4 +408,691 @@ void write_out() {
 	uart0_putc('\n');
 }
 
-#endif
\ No newline at end of file
+/*
+	timed receives and sends give up when nobody shows up in time,
+	and a sleeping task comes back after its TICKs
+	expected trace is a b c d e f
+*/
+void tmo_test(){
+	PID to = Task_Create_RR(tmo_reciever, 0);
+	Task_Create_RR(tmo_sender, to);
+}
+
+void tmo_reciever(){
+	unsigned int msg;
+	PID from;
+	if (!Msg_Recv_Timeout(0xff, &msg, &from, 0)) {
+		results[cur++] = 'a';
+	}
+	if (Msg_Recv_Timeout(0xff, &msg, &from, 50)) {
+		results[cur++] = msg;
+		Msg_Rply(from, 0);
+	}
+	if (!Msg_Recv_Timeout(0xff, &msg, &from, 2)) {
+		results[cur++] = 'e';
+	}
+	if (!Msg_Send_Timeout(from, 1, &msg, 2)) { // sender is asleep
+		results[cur++] = 'f';
+	}
+	results[cur++] = 0;
+	Task_Create_RR(dead_test, 0);
+}
+
+void tmo_sender(){
+	PID to = Task_GetArg();
+	unsigned int msg = 'c';
+	Task_Sleep(2);
+	results[cur++] = 'b';
+	if (Msg_Send_Timeout(to, 1, &msg, 5)) {
+		results[cur++] = 'd';
+	}
+	Task_Sleep(10);
+}
+
+/*
+	senders still queued on a task when it terminates give up:
+	Msg_Send() leaves the message as it was, and Msg_Send_Timeout()
+	fails before its timeout; a task that takes over the dead one's
+	PD is not disturbed when that timeout would have run out (c)
+	expected trace is a b c
+*/
+void dead_test(){
+	PID to = Task_Create_RR(dead_reciever, 0);
+	Task_Create_RR(dead_sender, to);
+	Task_Create_RR(dead_timed_sender, to);
+}
+
+void dead_reciever(){
+	Task_Sleep(2); // let both senders block on us, then terminate
+}
+
+void dead_sender(){
+	PID to = Task_GetArg();
+	unsigned int msg = 'a';
+	Msg_Send(to, 1, &msg);
+	results[cur++] = msg;
+}
+
+void dead_timed_sender(){
+	PID to = Task_GetArg();
+	unsigned int msg = 'b';
+	uint32_t start = Now();
+	if (!Msg_Send_Timeout(to, 1, &msg, 5) && Now() - start < 5 * MSECPERTICK) {
+		results[cur++] = msg;
+	}
+	to = Task_Create_RR(dead_reuse, 0);
+	Task_Sleep(10);
+	msg = 0;
+	Msg_Send(to, 1, &msg);
+	results[cur++] = msg;
+	results[cur++] = 0;
+	Task_Create_RR(time_test, 0);
+}
+
+void dead_reuse(){
+	unsigned int msg;
+	PID from = Msg_Recv(0xff, &msg);
+	Msg_Rply(from, 'c');
+}
+
+/*
+	Now_us() moves within a TICK, agrees with Now(), and measures
+	a Task_Sleep()
+	expected trace is a b c
+*/
+void time_test(){
+	uint32_t t0 = Now_us();
+	uint32_t t1;
+	uint32_t ms;
+	while ((t1 = Now_us()) == t0) {
+	}
+	if (t1 - t0 < 1000UL * MSECPERTICK) {
+		results[cur++] = 'a';
+	}
+	t1 = Now_us();
+	ms = Now();
+	if (ms - t1 / 1000 <= 1) {
+		results[cur++] = 'b';
+	}
+	t0 = Now_us();
+	Task_Sleep(5);
+	t1 = Now_us() - t0;
+	if (t1 > 4000UL * MSECPERTICK && t1 < 6000UL * MSECPERTICK) {
+		results[cur++] = 'c';
+	}
+	results[cur++] = 0;
+	Task_Create_System(stats_test, 0);
+}
+
+/*
+	a periodic task's jobs of about 2 ms are measured as such, and
+	the RR task it preempts counts the preemptions; built without
+	EXEC_STATS, the kernel must instead report no statistics at all
+	(the host Makefile defines EXEC_STATS for os.c and this file alike)
+	expected trace is a b c d
+*/
+void stats_test(){
+	PID spinner = Task_Create_RR(stats_spinner, 0);
+	Task_Create_Period(stats_periodic, spinner, 5, 1, 0);
+}
+
+void stats_periodic(){
+	TASK_STATS s;
+	uint8_t i;
+	for(i = 0; i < 3; ++i) {
+		uint32_t t0 = Now_us();
+		while (Now_us() - t0 < 2000) {
+		}
+		Task_Next();
+	}
+#ifdef EXEC_STATS
+	if (Task_Stats(Task_Pid(), &s) && s.jobs == 3) {
+		results[cur++] = 'a';
+	}
+	if (s.exec_min >= 2000 && s.exec_max < 1000UL * MSECPERTICK) {
+		results[cur++] = 'b';
+	}
+	if (s.overruns == 0 && s.deadline_misses == 0) {
+		results[cur++] = 'c';
+	}
+	if (Task_Stats(Task_GetArg(), &s) && s.preemptions >= 3) {
+		results[cur++] = 'd';
+	}
+#else
+	if (!Task_Stats(Task_Pid(), &s)) {
+		results[cur++] = 'a';
+		results[cur++] = 'b';
+		results[cur++] = 'c';
+	}
+	if (!Task_Stats(Task_GetArg(), &s)) {
+		results[cur++] = 'd';
+	}
+#endif
+	results[cur++] = 0;
+	stats_done = 1;
+	Task_Create_RR(overrun_test, 0); // runs once this task is gone
+}
+
+void stats_spinner(){
+	while (!stats_done) {
+	}
+}
+
+/*
+	periodic jobs that run far too long are let off as their
+	overrun policy says, instead of aborting the RTOS, and a job
+	of a task with a wcet of 0 may run into the next TICK (d); a
+	job let off by skipping a release is not checked again (e f)
+	expected trace is a b c d e f
+*/
+void spin_us(uint32_t us){
+	uint32_t t0 = Now_us();
+	while (Now_us() - t0 < us) {
+	}
+}
+
+void overrun_test(){
+	PID p = Task_Create_Period(overrun_shift, 0, 10, 1, 5);
+	Task_Overrun_Policy(p, OVERRUN_SHIFT);
+}
+
+void overrun_shift(){
+	spin_us(150000UL); // past wcet, and past the period too
+	Task_Next();
+	if (Task_Violations(Task_Pid()) > 0) {
+		results[cur++] = 'a';
+	}
+	Task_Create_RR(overrun_demote_setup, 0);
+}
+
+void overrun_demote_setup(){
+	PID p = Task_Create_Period(overrun_demote, 0, 10, 1, 5);
+	Task_Overrun_Policy(p, OVERRUN_DEMOTE);
+}
+
+void overrun_demote(){
+	results[cur++] = 'b';
+	spin_us(150000UL); // past wcet, and past the period too
+	Task_Next(); // a RR task now, so this does not wait for a period
+	if (Task_Violations(Task_Pid()) == 1) {
+		results[cur++] = 'c';
+	}
+	Task_Create_RR(overrun_untimed_setup, 0);
+}
+
+void overrun_untimed_setup(){
+	Task_Create_Period(overrun_untimed, 0, 4, 0, 1); // aborts if it is late
+}
+
+void overrun_untimed(){
+	spin_us(15000UL); // past the TICK it was released in
+	Task_Next();
+	if (Task_Violations(Task_Pid()) == 0) {
+		results[cur++] = 'd';
+	}
+	Task_Create_RR(overrun_skip_setup, 0);
+}
+
+void overrun_skip_setup(){
+	PID p = Task_Create_Period(overrun_skip, 0, 4, 1, 5);
+	Task_Overrun_Policy(p, OVERRUN_SKIP);
+}
+
+void overrun_skip(){
+	uint32_t start = Now();
+	spin_us(55000UL); // past wcet, and past the next release
+	Task_Next(); // the release after that one is the next job
+	if (Now() - start >= 75) {
+		results[cur++] = 'e';
+	}
+	if (Task_Violations(Task_Pid()) == 1) {
+		results[cur++] = 'f';
+	}
+	results[cur++] = 0;
+	Task_Create_RR(hand_test, 0);
+}
+
+/*
+	a receiver woken up by Msg_Send(), and a sender woken up by
+	Msg_Rply_Recv(), run ahead of a RR task that was ready before them
+	expected trace is a b c d e f
+*/
+void hand_test(){
+	PID to = Task_Create_RR(hand_server, 0);
+	Task_Create_RR(hand_client, to);
+	Task_Create_RR(hand_bystander, 0);
+}
+
+void hand_server(){
+	unsigned int msg;
+	PID from = Msg_Recv(0xff, &msg);
+	while (msg != 0) {
+		results[cur++] = msg;
+		from = Msg_Rply_Recv(from, msg + 1, 0xff, &msg);
+	}
+	Msg_Rply(from, 0);
+}
+
+void hand_client(){
+	PID to = Task_GetArg();
+	unsigned int msg = 'a';
+	Task_Next(); // let hand_test create the bystander
+	Msg_Send(to, 1, &msg);
+	results[cur++] = msg;
+	msg = 'c';
+	Msg_Send(to, 1, &msg);
+	results[cur++] = msg;
+	msg = 0;
+	Msg_Send(to, 1, &msg); // a reply of our level does not preempt the server
+	results[cur++] = 'f';
+	results[cur++] = 0;
+	Task_Create_RR(lwt_test, 0);
+}
+
+void hand_bystander(){
+	results[cur++] = 'e';
+}
+
+/*
+	two lightweight tasks, every 2 TICKs from now and every 3 TICKs
+	from the next TICK on, each job picking up after the last one's
+	LWT_NEXT(); at TICK 4, b was queued for its release first
+	expected trace is a b a b a
+*/
+void lwt_test(){
+	Lwt_Create_Period(lwt_a, 0, 2, 0);
+	Lwt_Create_Period(lwt_b, 0, 3, 1);
+}
+
+uint8_t lwt_a(LWT *t){
+	LWT_BEGIN(t);
+	results[cur++] = 'a';
+	LWT_NEXT(t);
+	results[cur++] = 'a';
+	LWT_NEXT(t);
+	results[cur++] = 'a';
+	results[cur++] = 0;
+	Task_Create_RR(lwt_order_test, 0);
+	LWT_END(t);
+}
+
+uint8_t lwt_b(LWT *t){
+	LWT_BEGIN(t);
+	results[cur++] = 'b';
+	LWT_NEXT(t);
+	results[cur++] = 'b';
+	LWT_END(t);
+}
+
+/*
+	an LWT job waits its turn among the periodic jobs: released on
+	the same TICK as a periodic job that comes first by release order,
+	deadline and period alike, it runs after it
+	expected trace is p l
+*/
+void lwt_order_test(){
+	Lwt_Create_Period(lwt_order_l, 0, 6, 2);
+	Task_Create_Period(lwt_order_p, 0, 3, 0, 2);
+}
+
+uint8_t lwt_order_l(LWT *t){
+	LWT_BEGIN(t);
+	results[cur++] = 'l';
+	results[cur++] = 0;
+	Task_Create_RR(job_test, 0);
+	LWT_END(t);
+}
+
+void lwt_order_p(){
+	results[cur++] = 'p';
+}
+
+/*
+	two run-to-completion tasks of the same period, released 2 TICKs
+	apart: the second one's job starts on the frame the first one's has
+	left, which records c
+	expected trace is a b c a b
+*/
+static uintptr_t job_frame;
+static uint8_t job_runs;
+
+void job_test(){
+	job_frame = 0;
+	job_runs = 0;
+	Task_Create_Job(job_step, 'a', 4, 1, 0);
+	Task_Create_Job(job_step, 'b', 4, 1, 2);
+}
+
+void job_step(){
+	volatile char here;
+	results[cur++] = Task_GetArg();
+	if (++job_runs == 1) {
+		job_frame = (uintptr_t)&here;
+	} else if (job_runs == 2 && (uintptr_t)&here == job_frame) {
+		results[cur++] = 'c';
+	} else if (job_runs >= 3) {
+		if (job_runs == 4) {
+			results[cur++] = 0;
+			Task_Create_RR(churn_test, 0);
+		}
+		Task_Terminate();
+	}
+}
+
+/*
+	creates many more short-lived System tasks than there are task
+	slots, one after the other: each one's PID is the one its creator
+	got (a), is not given out again by the next one (b), and no longer
+	works once the task is gone (c); creating one while every slot is
+	taken fails (d), and works again once one is free (e)
+	expected trace is a b c d e
+*/
+static PID churn_pid;
+
+void churn_test(){
+	PID pid;
+	PID last = 0;
+	uint8_t same = 1, fresh = 1, stale = 1;
+	uint16_t i;
+
+	for (i = 0; i < 300; i++) {
+		pid = Task_Create_System(churn_task, 0);
+		if (pid != churn_pid) {
+			same = 0;
+		}
+		if (pid == last) {
+			fresh = 0;
+		}
+		if (Task_Stack_Used(pid) != 0) {
+			stale = 0;
+		}
+		last = pid;
+	}
+	if (same) {
+		results[cur++] = 'a';
+	}
+	if (fresh) {
+		results[cur++] = 'b';
+	}
+	if (stale) {
+		results[cur++] = 'c';
+	}
+	for (i = 0; i < 300 && Task_Create_System(churn_sleeper, 0) != 0; i++) {
+	}
+	if (i < 300) {
+		results[cur++] = 'd';
+	}
+	Task_Sleep(10);
+	if (Task_Create_System(churn_task, 0) != 0) {
+		results[cur++] = 'e';
+	}
+	results[cur++] = 0;
+	Task_Create_RR(evt_test, 0);
+}
+
+void churn_task(){
+	churn_pid = Task_Pid();
+}
+
+void churn_sleeper(){
+	Task_Sleep(5);
+}
+
+/*
+	two System tasks wait on the same pair of flags: the first for
+	either one, which it clears, the second for both; the second flag
+	alone is then not enough, since the first one is gone
+	expected trace is a b d c
+*/
+static EVENT_GROUP evt_group;
+
+void evt_test(){
+	evt_group = Event_Init();
+	Task_Create_System(evt_any, 0);
+	Task_Create_System(evt_all, 0);
+	results[cur++] = 'a';
+	Event_Set(evt_group, 0x01);
+	Event_Set(evt_group, 0x02);
+	results[cur++] = 'd';
+	Event_Set(evt_group, 0x01);
+	results[cur++] = 0;
+	Task_Create_RR(tmr_test, 0);
+}
+
+void evt_any(){
+	Event_Wait(evt_group, 0x03, EVENT_ANY | EVENT_CLEAR);
+	results[cur++] = 'b';
+}
+
+void evt_all(){
+	if (Event_Wait(evt_group, 0x03, EVENT_ALL) == 0x03) {
+		results[cur++] = 'c';
+	}
+}
+
+/*
+	software timers: one every 2 TICKs (b), which stops itself after
+	three callbacks, a one-shot one after 3 TICKs (a), one stopped
+	before it expires (x), and a one-shot one after 21 TICKs, more than
+	a turn of the wheel, by when only it is still running (c)
+	expected trace is b a b b c
+*/
+static SOFT_TIMER tmr_auto;
+static SOFT_TIMER tmr_one;
+static SOFT_TIMER tmr_long;
+static uint8_t tmr_count;
+
+void tmr_test(){
+	SOFT_TIMER stopped;
+
+	tmr_count = 0;
+	tmr_auto = Soft_Timer_Create(tmr_fire, 'b', 2, SOFT_TIMER_AUTO_RELOAD);
+	tmr_one = Soft_Timer_Create(tmr_fire, 'a', 3, SOFT_TIMER_ONE_SHOT);
+	stopped = Soft_Timer_Create(tmr_fire, 'x', 1, SOFT_TIMER_ONE_SHOT);
+	tmr_long = Soft_Timer_Create(tmr_fire, 'c', 21, SOFT_TIMER_ONE_SHOT);
+	Soft_Timer_Start(tmr_auto);
+	Soft_Timer_Start(tmr_one);
+	Soft_Timer_Start(stopped);
+	Soft_Timer_Start(tmr_long);
+	Soft_Timer_Stop(stopped);
+}
+
+void tmr_fire(int arg){
+	if (arg == 'c') {
+		if (Soft_Timer_Active(tmr_auto) || Soft_Timer_Active(tmr_one)) {
+			return;
+		}
+		results[cur++] = arg;
+		results[cur++] = 0;
+		Task_Create_RR(admit_test, 0);
+		return;
+	}
+	results[cur++] = arg;
+	if (arg == 'b' && ++tmr_count == 3) {
+		Soft_Timer_Stop(tmr_auto);
+	}
+}
+
+/*
+	admission control refuses, with a return of 0 and an error code,
+	a task whose wcet is not less than its period (a) and one that
+	would push the utilization over 1 (b); refused jobs take no stack
+	(c), and the task that was admitted runs (d)
+	expected trace is a b c d
+*/
+void admit_test(){
+	uint8_t i;
+	uint8_t refused = 1;
+
+	if (Task_Create_Period(admit_periodic, 0, 4, 4, 0) == 0 && Task_Admission_Error() != 0) {
+		results[cur++] = 'a';
+	}
+	Task_Create_Period(admit_periodic, 0, 8, 6, 5);
+	if (Task_Create_Period(admit_periodic, 0, 8, 3, 6) == 0 && Task_Admission_Error() != 0) {
+		results[cur++] = 'b';
+	}
+	for (i = 0; i < 10; i++) {
+		if (Task_Create_Job(admit_job, 0, 10 + i, 10 + i, 0) != 0) {
+			refused = 0;
+		}
+	}
+	if (refused) {
+		results[cur++] = 'c';
+	}
+}
+
+void admit_periodic(){
+	results[cur++] = 'd';
+	results[cur++] = 0;
+	Task_Create_RR(phand_test, 0); // runs once this task is gone
+}
+
+void admit_job(){
+}
+
+/*
+	a periodic server handed a message by a periodic client of its level:
+	under EDF and RM it waits for the job with the earlier deadline (b,
+	period 6) but goes ahead of the later one (l, period 12); under FIFO
+	it runs straight away. Its reply does not preempt it (r after s).
+	The tasks block in messages here only to reach the handoff.
+	expected trace is c s b l r (FIFO), c b s r l (EDF, RM)
+*/
+static PID phand_to;
+static uint8_t phand_left;
+
+void phand_test(){
+	phand_left = 4;
+	phand_to = Task_Create_Period(phand_server, 0, 8, 0, 0);
+	Task_Create_Period(phand_client, 0, 4, 0, 1);
+	Task_Create_Period(phand_bystander, 'b', 6, 0, 1);
+	Task_Create_Period(phand_bystander, 'l', 12, 0, 1);
+}
+
+void phand_server(){
+	unsigned int msg;
+	PID from = Msg_Recv(0xff, &msg);
+
+	results[cur++] = msg;
+	Msg_Rply(from, 'r');
+	phand_done();
+}
+
+void phand_client(){
+	unsigned int msg = 's';
+
+	results[cur++] = 'c';
+	Msg_Send(phand_to, 1, &msg);
+	results[cur++] = msg;
+	phand_done();
+}
+
+void phand_bystander(){
+	results[cur++] = Task_GetArg();
+	phand_done();
+}
+
+void phand_done(){
+	if (--phand_left == 0) {
+		results[cur++] = 0;
+		Task_Create_RR(slot_test, 0);
+	}
+}
+
+/*
+	a periodic PD taken in turn by run-to-completion tasks and by tasks
+	with a stack of their own, many more times than the stack arena has
+	stacks: each of the latter gets the PD's stack back (a), and
+	every task runs (b)
+	expected trace is a b
+*/
+static uint16_t slot_runs;
+
+void slot_test(){
+	uint16_t i;
+
+	slot_runs = 0;
+	for (i = 0; i < 200; i++) {
+		Task_Create_Job(slot_job, 0, 4, 0, 0);
+		Task_Create_Period(slot_task, 0, 4, 0, 0);
+	}
+	results[cur++] = 'a';
+	if (slot_runs == 400) {
+		results[cur++] = 'b';
+	}
+	results[cur++] = 0;
+	Task_Create_RR(isr_test, 0);
+}
+
+void slot_job(){
+	++slot_runs;
+	Task_Terminate();
+}
+
+void slot_task(){
+	++slot_runs;
+}
+
+/*
+	an interrupt handler sets a flag with Event_Set_ISR(): the System
+	task waiting for it stays blocked while the RR task that was
+	interrupted keeps the CPU (a), until the next TICK (b); if the CPU
+	was idle, it wakes up at once, long before the RR task's sleep of
+	5 TICKs is over (c)
+	expected trace is a b c
+*/
+static EVENT_GROUP isr_group;
+static volatile uint8_t isr_ran;
+static volatile uint8_t isr_woken;
+static volatile uint32_t isr_woken_at;
+
+static void isr_raise(){
+	isr_ran = 0;
+#ifdef OS_HOST
+	Port_Interrupt(isr_handler);
+#else
+	cli();
+	isr_handler();
+	sei();
+#endif
+}
+
+void isr_test(){
+	uint32_t slept_at;
+
+	isr_group = Event_Init();
+	isr_woken = 0;
+	Task_Create_System(isr_waiter, 0);
+	isr_raise();
+	while (!isr_ran) {
+	}
+	if (isr_woken == 0) {
+		results[cur++] = 'a';
+	}
+	while (isr_woken == 0) {
+	}
+	results[cur++] = 'b';
+	slept_at = Now();
+	isr_raise();
+	Task_Sleep(5);
+	if (isr_woken == 2 && isr_woken_at - slept_at < 2 * MSECPERTICK) {
+		results[cur++] = 'c';
+	}
+	results[cur++] = 0;
+	Task_Create_RR(write_out, 0);
+}
+
+void isr_waiter(){
+	Event_Wait(isr_group, 0x01, EVENT_ANY | EVENT_CLEAR);
+	isr_woken = 1;
+	Event_Wait(isr_group, 0x01, EVENT_ANY | EVENT_CLEAR);
+	isr_woken_at = Now();
+	isr_woken = 2;
+}
+
+void isr_handler(){
+	Event_Set_ISR(isr_group, 0x01);
+	isr_ran = 1;
+}
+
+#endif